@@ -0,0 +1,404 @@
+/*
+ *  RUFS benchmark suite
+ *
+ *  Runs a fixed set of workloads against a mounted file system and
+ *  reports, per operation, throughput and p50/p99/p999 latency as one
+ *  JSON object per line (or CSV with -c) so results can be diffed
+ *  across releases.
+ *
+ *  usage: rufs_bench [-n ops] [-s file_mb] [-f files] [-w width]
+ *                    [-D depth] [-e entries] [-r seed] [-c] [-k] <mountdir>
+ *
+ *  The mount point may also be given with RUFS_MOUNT.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdarg.h>
+
+#define BLOCKSIZE 4096
+#define FSPATHLEN 4096
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+static char root[FSPATHLEN];
+static char buf[BLOCKSIZE];
+
+static int n_ops = 4096;	/* random read/write operations */
+static int file_mb = 16;	/* size of the sequential file */
+static int n_files = 1000;	/* small files to create */
+static int width = 256;		/* mkdir fan-out */
+static int depth = 32;		/* deep path stat depth */
+static int n_entries = 2000;	/* entries in the readdir directory */
+static unsigned seed = 1;
+static int csv;
+static int keep;
+
+/* latency samples in nanoseconds for the running operation */
+static uint64_t *lat;
+static int nlat, maxlat;
+static uint64_t run_begin;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void die(const char *what, const char *path) {
+	fprintf(stderr, "rufs_bench: %s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+/* Format a path into path[size]; a path that does not fit ends the run */
+__attribute__((format(printf, 3, 4)))
+static void mkpath(char *path, size_t size, const char *fmt, ...) {
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(path, size, fmt, ap);
+	va_end(ap);
+	if (len < 0 || (size_t)len >= size) {
+		fprintf(stderr, "rufs_bench: path too long: %s...\n", path);
+		exit(1);
+	}
+}
+
+static void begin_op(int expected) {
+	if (expected > maxlat) {
+		maxlat = expected;
+		lat = realloc(lat, maxlat * sizeof(*lat));
+		if (lat == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	nlat = 0;
+	run_begin = now_ns();
+}
+
+static inline void sample(uint64_t start) {
+	lat[nlat++] = now_ns() - start;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile over the sorted samples, in microseconds */
+static double pct(double p) {
+	int idx;
+	if (nlat == 0)
+		return 0;
+	idx = (int)(p * nlat + 0.999999) - 1;
+	if (idx < 0)
+		idx = 0;
+	if (idx >= nlat)
+		idx = nlat - 1;
+	return lat[idx] / 1000.0;
+}
+
+static void end_op(const char *name, uint64_t bytes) {
+	double secs = (now_ns() - run_begin) / 1e9;
+	double ops_s, mb_s;
+
+	qsort(lat, nlat, sizeof(*lat), cmp_u64);
+	ops_s = secs > 0 ? nlat / secs : 0;
+	mb_s = secs > 0 ? bytes / secs / (1024.0 * 1024.0) : 0;
+
+	if (csv)
+		printf("%s,%d,%llu,%.6f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+			name, nlat, (unsigned long long)bytes, secs, ops_s, mb_s,
+			pct(0.50), pct(0.99), pct(0.999),
+			nlat ? lat[nlat - 1] / 1000.0 : 0);
+	else
+		printf("{\"op\":\"%s\",\"ops\":%d,\"bytes\":%llu,\"secs\":%.6f,"
+			"\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"p50_us\":%.2f,"
+			"\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f}\n",
+			name, nlat, (unsigned long long)bytes, secs, ops_s, mb_s,
+			pct(0.50), pct(0.99), pct(0.999),
+			nlat ? lat[nlat - 1] / 1000.0 : 0);
+	fflush(stdout);
+}
+
+static void bench_seq(const char *path) {
+	int i, fd, nblocks = file_mb * (1024 * 1024 / BLOCKSIZE);
+	uint64_t t;
+
+	// Step 1: Sequential write, one block per call
+	if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, FILEPERM)) < 0)
+		die("open", path);
+	begin_op(nblocks);
+	for (i = 0; i < nblocks; i++) {
+		memset(buf, 0x61 + i % 26, BLOCKSIZE);
+		t = now_ns();
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+			die("write", path);
+		sample(t);
+	}
+	if (fsync(fd) < 0)
+		die("fsync", path);
+	end_op("seq_write", (uint64_t)nblocks * BLOCKSIZE);
+	close(fd);
+
+	// Step 2: Sequential read back, checking the pattern
+	if ((fd = open(path, O_RDONLY)) < 0)
+		die("open", path);
+	begin_op(nblocks);
+	for (i = 0; i < nblocks; i++) {
+		t = now_ns();
+		if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+			die("read", path);
+		sample(t);
+		if (buf[0] != 0x61 + i % 26 || buf[BLOCKSIZE - 1] != 0x61 + i % 26) {
+			fprintf(stderr, "rufs_bench: %s: bad data at block %d\n", path, i);
+			exit(1);
+		}
+	}
+	end_op("seq_read", (uint64_t)nblocks * BLOCKSIZE);
+	close(fd);
+}
+
+static void bench_rand(const char *path) {
+	int i, fd, nblocks = file_mb * (1024 * 1024 / BLOCKSIZE);
+	off_t off;
+	uint64_t t;
+
+	if ((fd = open(path, O_RDWR)) < 0)
+		die("open", path);
+
+	// Step 1: Block-aligned random overwrites inside the existing file
+	srand(seed);
+	begin_op(n_ops);
+	for (i = 0; i < n_ops; i++) {
+		off = (off_t)(rand() % nblocks) * BLOCKSIZE;
+		memset(buf, 0x41 + i % 26, BLOCKSIZE);
+		t = now_ns();
+		if (pwrite(fd, buf, BLOCKSIZE, off) != BLOCKSIZE)
+			die("pwrite", path);
+		sample(t);
+	}
+	if (fsync(fd) < 0)
+		die("fsync", path);
+	end_op("rand_write", (uint64_t)n_ops * BLOCKSIZE);
+
+	// Step 2: Random reads over a different sequence of blocks
+	srand(seed + 1);
+	begin_op(n_ops);
+	for (i = 0; i < n_ops; i++) {
+		off = (off_t)(rand() % nblocks) * BLOCKSIZE;
+		t = now_ns();
+		if (pread(fd, buf, BLOCKSIZE, off) != BLOCKSIZE)
+			die("pread", path);
+		sample(t);
+	}
+	end_op("rand_read", (uint64_t)n_ops * BLOCKSIZE);
+	close(fd);
+}
+
+static void bench_create(const char *dir) {
+	char path[FSPATHLEN];
+	int i, fd;
+	uint64_t t;
+
+	if (mkdir(dir, DIRPERM) < 0)
+		die("mkdir", dir);
+
+	// Small files: create, one partial block of data, close
+	memset(buf, 0x7a, BLOCKSIZE);
+	begin_op(n_files);
+	for (i = 0; i < n_files; i++) {
+		mkpath(path, sizeof(path), "%s/f%d", dir, i);
+		t = now_ns();
+		if ((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, FILEPERM)) < 0)
+			die("create", path);
+		if (write(fd, buf, 512) != 512)
+			die("write", path);
+		close(fd);
+		sample(t);
+	}
+	end_op("create", (uint64_t)n_files * 512);
+}
+
+static void bench_mkdir(const char *dir) {
+	char path[FSPATHLEN];
+	int i;
+	uint64_t t;
+
+	if (mkdir(dir, DIRPERM) < 0)
+		die("mkdir", dir);
+
+	begin_op(width);
+	for (i = 0; i < width; i++) {
+		mkpath(path, sizeof(path), "%s/d%d", dir, i);
+		t = now_ns();
+		if (mkdir(path, DIRPERM) < 0)
+			die("mkdir", path);
+		sample(t);
+	}
+	end_op("mkdir", 0);
+}
+
+static void bench_deep_stat(const char *dir) {
+	char path[FSPATHLEN];
+	struct stat st;
+	size_t len;
+	int i;
+	uint64_t t;
+
+	// Step 1: Build a chain of depth nested directories
+	len = snprintf(path, sizeof(path), "%s", dir);
+	if (mkdir(path, DIRPERM) < 0)
+		die("mkdir", path);
+	for (i = 0; i < depth; i++) {
+		len += snprintf(path + len, sizeof(path) - len, "/n%d", i);
+		if (len >= sizeof(path) - 16) {
+			fprintf(stderr, "rufs_bench: depth %d too large\n", depth);
+			exit(1);
+		}
+		if (mkdir(path, DIRPERM) < 0)
+			die("mkdir", path);
+	}
+
+	// Step 2: Repeatedly resolve the full path to the leaf
+	begin_op(n_ops);
+	for (i = 0; i < n_ops; i++) {
+		t = now_ns();
+		if (stat(path, &st) < 0)
+			die("stat", path);
+		sample(t);
+	}
+	end_op("deep_stat", 0);
+}
+
+static void bench_readdir(const char *dir) {
+	char path[FSPATHLEN];
+	struct dirent *de;
+	DIR *d;
+	int i, fd, n, iters = 32;
+	uint64_t t;
+
+	// Step 1: Populate one large directory
+	if (mkdir(dir, DIRPERM) < 0)
+		die("mkdir", dir);
+	for (i = 0; i < n_entries; i++) {
+		mkpath(path, sizeof(path), "%s/e%d", dir, i);
+		if ((fd = creat(path, FILEPERM)) < 0)
+			die("creat", path);
+		close(fd);
+	}
+
+	// Step 2: Each sample is a full opendir/readdir/closedir pass
+	begin_op(iters);
+	for (i = 0; i < iters; i++) {
+		t = now_ns();
+		if ((d = opendir(dir)) == NULL)
+			die("opendir", dir);
+		n = 0;
+		while ((de = readdir(d)) != NULL)
+			n++;
+		closedir(d);
+		sample(t);
+		if (n < n_entries) {
+			fprintf(stderr, "rufs_bench: readdir %s: saw %d of %d entries\n",
+				dir, n, n_entries);
+			exit(1);
+		}
+	}
+	end_op("readdir", 0);
+}
+
+/* Remove the work tree; best effort, errors are ignored */
+static void cleanup(const char *path) {
+	char child[FSPATHLEN];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	if (lstat(path, &st) < 0)
+		return;
+	if (!S_ISDIR(st.st_mode)) {
+		unlink(path);
+		return;
+	}
+	if ((d = opendir(path)) != NULL) {
+		while ((de = readdir(d)) != NULL) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			mkpath(child, sizeof(child), "%s/%s", path, de->d_name);
+			cleanup(child);
+		}
+		closedir(d);
+	}
+	rmdir(path);
+}
+
+static void usage() {
+	fprintf(stderr, "usage: rufs_bench [-n ops] [-s file_mb] [-f files] "
+		"[-w width] [-D depth] [-e entries] [-r seed] [-c] [-k] <mountdir>\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	char path[FSPATHLEN];
+	const char *mnt = getenv("RUFS_MOUNT");
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:f:w:D:e:r:ck")) != -1) {
+		switch (c) {
+		case 'n': n_ops = atoi(optarg); break;
+		case 's': file_mb = atoi(optarg); break;
+		case 'f': n_files = atoi(optarg); break;
+		case 'w': width = atoi(optarg); break;
+		case 'D': depth = atoi(optarg); break;
+		case 'e': n_entries = atoi(optarg); break;
+		case 'r': seed = strtoul(optarg, NULL, 0); break;
+		case 'c': csv = 1; break;
+		case 'k': keep = 1; break;
+		default: usage();
+		}
+	}
+	if (optind < argc)
+		mnt = argv[optind];
+	if (mnt == NULL || n_ops <= 0 || file_mb <= 0 || n_files <= 0 ||
+			width <= 0 || depth <= 0 || n_entries <= 0)
+		usage();
+
+	// Every run works in its own directory so reruns never collide
+	mkpath(root, sizeof(root), "%s/bench.%d", mnt, (int)getpid());
+	if (mkdir(root, DIRPERM) < 0)
+		die("mkdir", root);
+
+	if (csv)
+		printf("op,ops,bytes,secs,ops_per_sec,mb_per_sec,"
+			"p50_us,p99_us,p999_us,max_us\n");
+
+	mkpath(path, sizeof(path), "%s/seqfile", root);
+	bench_seq(path);
+	bench_rand(path);
+	mkpath(path, sizeof(path), "%s/small", root);
+	bench_create(path);
+	mkpath(path, sizeof(path), "%s/fanout", root);
+	bench_mkdir(path);
+	mkpath(path, sizeof(path), "%s/deep", root);
+	bench_deep_stat(path);
+	mkpath(path, sizeof(path), "%s/large", root);
+	bench_readdir(path);
+
+	if (!keep)
+		cleanup(root);
+	free(lat);
+	return 0;
+}
@@ -8,7 +8,7 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <time.h>
-/* You need to change this macro to your TFS mount point*/
+/* Default mount point; override with argv[1] or RUFS_MOUNT */
 #define TESTDIR "/tmp/npd59/mountdir"
 
 #define N_FILES 100
@@ -19,13 +19,33 @@
 #define DIRPERM 0755
 
 char buf[BLOCKSIZE];
+const char *testdir = TESTDIR;
+
+/* Returns testdir + name in a static buffer */
+char *tpath(const char *name) {
+	static char path[FSPATHLEN];
+	snprintf(path, FSPATHLEN, "%s%s", testdir, name);
+	return path;
+}
+
+/* Wall-clock seconds; clock() only counts this process's CPU time */
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 int main(int argc, char **argv) {
-	clock_t begin = clock();
+	double begin = now();
 	int i, fd = 0, ret = 0;
 	struct stat st;
 
-	if ((fd = creat(TESTDIR "/file", FILEPERM)) < 0) {
+	if (argc > 1)
+		testdir = argv[1];
+	else if (getenv("RUFS_MOUNT"))
+		testdir = getenv("RUFS_MOUNT");
+
+	if ((fd = creat(tpath("/file"), FILEPERM)) < 0) {
 		perror("creat");
 		printf("TEST 1: File create failure \n");
 		exit(1);
@@ -60,7 +80,7 @@ int main(int argc, char **argv) {
 
 
 	/* Open for reading */
-	if ((fd = open(TESTDIR "/file", FILEPERM)) < 0) {
+	if ((fd = open(tpath("/file"), FILEPERM)) < 0) {
 		perror("open");
 		exit(1);
 	}
@@ -88,10 +108,10 @@ int main(int argc, char **argv) {
 	close(fd);
 
 	/* Directory creation test */
-	if ((ret = mkdir(TESTDIR "/files", DIRPERM)) < 0) {
+	if ((ret = mkdir(tpath("/files"), DIRPERM)) < 0) {
 		perror("mkdir");
 		printf("TEST 5: failure. Check if dir %s already exists, and "
-			"if it exists, manually remove and re-run \n", TESTDIR "/files");
+			"if it exists, manually remove and re-run \n", tpath("/files"));
 		exit(1);
 	}
 	printf("TEST 5: Directory create success \n");
@@ -102,7 +122,7 @@ int main(int argc, char **argv) {
 		char subdir_path[FSPATHLEN];
 		memset(subdir_path, 0, FSPATHLEN);
 
-		sprintf(subdir_path, "%s%d", TESTDIR "/files/dir", i);
+		sprintf(subdir_path, "%s/files/dir%d", testdir, i);
 		if ((ret = mkdir(subdir_path, DIRPERM)) < 0) {
 			perror("mkdir");
 			printf("TEST 6: Sub-directory create failure \n");
@@ -113,8 +133,7 @@ int main(int argc, char **argv) {
 	printf("TEST 6: Sub-directory create success \n");
 
 	printf("Benchmark completed \n");
-	clock_t end = clock();
-	double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
-	printf("Benchmark time spent: %lf",time_spent);
+	double time_spent = now() - begin;
+	printf("Benchmark time spent: %lf\n",time_spent);
 	return 0;
 }
@@ -8,7 +8,7 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <time.h>
-/* You need to change this macro to your TFS mount point*/
+/* Default mount point; override with argv[1] or RUFS_MOUNT */
 #define TESTDIR "/tmp/npd59/mountdir"
 
 #define N_FILES 100
@@ -20,14 +20,34 @@
 #define DIRPERM 0755
 
 char buf[BLOCKSIZE];
+const char *testdir = TESTDIR;
+
+/* Returns testdir + name in a static buffer */
+char *tpath(const char *name) {
+	static char path[FSPATHLEN];
+	snprintf(path, FSPATHLEN, "%s%s", testdir, name);
+	return path;
+}
+
+/* Wall-clock seconds; clock() only counts this process's CPU time */
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 int main(int argc, char **argv) {
-	clock_t begin = clock();
+	double begin = now();
 	int i, fd = 0, ret = 0;
 	struct stat st;
 
+	if (argc > 1)
+		testdir = argv[1];
+	else if (getenv("RUFS_MOUNT"))
+		testdir = getenv("RUFS_MOUNT");
+
 	/* TEST 1: file create test */
-	if ((fd = creat(TESTDIR "/file", FILEPERM)) < 0) {
+	if ((fd = creat(tpath("/file"), FILEPERM)) < 0) {
 		perror("creat");
 		printf("TEST 1: File create failure \n");
 		exit(1);
@@ -62,7 +82,7 @@ int main(int argc, char **argv) {
 
 
 	/* Open for reading */
-	if ((fd = open(TESTDIR "/file", FILEPERM)) < 0) {
+	if ((fd = open(tpath("/file"), FILEPERM)) < 0) {
 		perror("open");
 		exit(1);
 	}
@@ -90,10 +110,10 @@ int main(int argc, char **argv) {
 
 
 	/* TEST 5: directory create test */
-	if ((ret = mkdir(TESTDIR "/files", DIRPERM)) < 0) {
+	if ((ret = mkdir(tpath("/files"), DIRPERM)) < 0) {
 		perror("mkdir");
 		printf("TEST 5: failure. Check if dir %s already exists, and "
-			"if it exists, manually remove and re-run \n", TESTDIR "/files");
+			"if it exists, manually remove and re-run \n", tpath("/files"));
 		exit(1);
 	}
 	printf("TEST 5: Directory create success \n");
@@ -104,7 +124,7 @@ int main(int argc, char **argv) {
 		char subdir_path[FSPATHLEN];
 		memset(subdir_path, 0, FSPATHLEN);
 
-		sprintf(subdir_path, "%s%d", TESTDIR "/files/dir", i);
+		sprintf(subdir_path, "%s/files/dir%d", testdir, i);
 		if ((ret = mkdir(subdir_path, DIRPERM)) < 0) {
 			perror("mkdir");
 			printf("TEST 6: Sub-directory create failure \n");
@@ -117,7 +137,7 @@ int main(int argc, char **argv) {
 		char subdir_path[FSPATHLEN];
 		memset(subdir_path, 0, FSPATHLEN);
 
-		sprintf(subdir_path, "%s%d", TESTDIR "/files/dir", i);
+		sprintf(subdir_path, "%s/files/dir%d", testdir, i);
 		if ((dir = opendir(subdir_path)) == NULL) {
 			perror("opendir");
 			printf("TEST 7: Sub-directory create failure \n");
@@ -127,6 +147,54 @@ int main(int argc, char **argv) {
 	printf("TEST 7: Sub-directory create success \n");
 
 
+	/* TEST 8: large file write test */
+	double large_begin = now();
+	if ((fd = creat(tpath("/largefile"), FILEPERM)) < 0) {
+		perror("creat");
+		printf("TEST 8: Large file create failure \n");
+		exit(1);
+	}
+
+	for (i = 0; i < ITERS_LARGE; i++) {
+		//memset with some random data
+		memset(buf, 0x61 + i % 26, BLOCKSIZE);
+
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 8: Large file write failure \n");
+			exit(1);
+		}
+	}
+
+	fstat(fd, &st);
+	if (st.st_size != ITERS_LARGE*BLOCKSIZE) {
+		printf("TEST 8: Large file write failure \n");
+		exit(1);
+	}
+	printf("TEST 8: Large file write Success \n");
+
+
+	/* TEST 9: large file read test */
+	close(fd);
+	if ((fd = open(tpath("/largefile"), O_RDONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	for (i = 0; i < ITERS_LARGE; i++) {
+		//clear buffer
+		memset(buf, 0, BLOCKSIZE);
+
+		if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || buf[0] != 0x61 + i % 26 ||
+				buf[BLOCKSIZE - 1] != 0x61 + i % 26) {
+			printf("TEST 9: Large file read failure \n");
+			exit(1);
+		}
+	}
+	printf("TEST 9: Large file read Success \n");
+	double large_time_spent = now() - large_begin;
+	printf("Large file (%d blocks) time spent: %lf\n", ITERS_LARGE, large_time_spent);
+
+
 	/* Close operation */	
 	if (close(fd) < 0) {
 		perror("close largefile");
@@ -134,8 +202,7 @@ int main(int argc, char **argv) {
 	}
 
 	printf("Benchmark completed \n");
-	clock_t end = clock();
-	double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
-	printf("Benchmark time spent: %lf",time_spent);
+	double time_spent = now() - begin;
+	printf("Benchmark time spent: %lf\n",time_spent);
 	return 0;
 }
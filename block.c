@@ -7,34 +7,637 @@
  *
  */
 
+#define _GNU_SOURCE	// O_DIRECT
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 
 #include "block.h"
+#include "stats.h"
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+#pragma push_macro("BLOCK_SIZE")	// linux/fs.h has its own
+#undef BLOCK_SIZE
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE
+#pragma pop_macro("BLOCK_SIZE")
+
+//Block cache: CACHE_BLOCKS buffers hashed into CACHE_BUCKETS chains by block number
+//While dirty blocks are held it grows by CACHE_GROW buffers at a time instead of writing them back,
+//up to the number of dirty blocks given to bio_hold()
+#define CACHE_BLOCKS	1024
+#define CACHE_GROW		256
+#define CACHE_BUCKETS	2048
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//Vectored reads or writes handed to the backend together
+#define DEV_BATCH 32
+
+//Buffer and offset alignment that O_DIRECT asks for
+#define DEV_ALIGN BLOCK_SIZE
 
 int diskfile = -1;
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+/*
+ * Device backends, all access to DISKFILE goes through one of them
+ */
+//One vectored read or write of a batch, res is what preadv/pwritev would return or -errno
+struct dev_io {
+	const struct iovec *iov;
+	int iovcnt;
+	off_t offset;
+	int write;
+	ssize_t res;
+};
+
+struct dev_backend {
+	const char *name;
+	int uncached;		// bio_read/bio_write bypass the block cache
+	int (*attach)();	// diskfile was just opened
+	void (*detach)();	// diskfile is about to be closed
+	ssize_t (*preadv)(const struct iovec *iov, int iovcnt, off_t offset);
+	ssize_t (*pwritev)(const struct iovec *iov, int iovcnt, off_t offset);
+	int (*sync)(int wait);	// start write-back, or with wait make it durable
+	int (*submit)(struct dev_io *ios, int n);	// run a batch, returns -1 if any of it failed
+};
+
+static const struct dev_backend *backend;
+
+//Run a batch one vector at a time through be
+static int serial_run(const struct dev_backend *be, struct dev_io *ios, int n) {
+	int retstat = 0;
+	for (int i = 0; i < n; i++) {
+		ios[i].res = ios[i].write ? be->pwritev(ios[i].iov, ios[i].iovcnt, ios[i].offset)
+			: be->preadv(ios[i].iov, ios[i].iovcnt, ios[i].offset);
+		if (ios[i].res < 0) {
+			ios[i].res = -errno;
+			retstat = -1;
+		}
+	}
+	return retstat;
+}
+
+static int serial_submit(struct dev_io *ios, int n) {
+	return serial_run(backend, ios, n);
+}
+
+//pread backend: one system call per vector
+static int pread_attach() {
+	return 0;
+}
+
+static void pread_detach() {
+}
+
+static ssize_t pread_preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+	return preadv(diskfile, iov, iovcnt, offset);
+}
+
+static ssize_t pread_pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
+	return pwritev(diskfile, iov, iovcnt, offset);
+}
+
+static int pread_sync(int wait) {
+	return wait ? fsync(diskfile) : 0;
+}
+
+static const struct dev_backend pread_backend = {
+	"pread", 0, pread_attach, pread_detach, pread_preadv, pread_pwritev, pread_sync, serial_submit
+};
+
+//mmap backend: the whole image is mapped, blocks are copied in and out of the mapping
+static unsigned char *dev_map = NULL;
+static size_t dev_map_size = 0;
+
+static int mmap_attach() {
+	struct stat st;
+	if (fstat(diskfile, &st) < 0 || st.st_size == 0)
+		return -1;
+	dev_map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+	if (dev_map == MAP_FAILED) {
+		dev_map = NULL;
+		perror("disk_mmap failed");
+		return -1;
+	}
+	dev_map_size = st.st_size;
+	return 0;
+}
+
+static void mmap_detach() {
+	if (dev_map) {
+		msync(dev_map, dev_map_size, MS_SYNC);
+		munmap(dev_map, dev_map_size);
+	}
+	dev_map = NULL;
+	dev_map_size = 0;
+}
+
+//Copies between the mapping and iov, stops at the end of the image like pread
+static ssize_t mmap_copy(const struct iovec *iov, int iovcnt, off_t offset, int write) {
+	ssize_t done = 0;
+	for (int i = 0; i < iovcnt && offset < (off_t)dev_map_size; i++) {
+		size_t len = iov[i].iov_len;
+		if (offset + len > dev_map_size)
+			len = dev_map_size - offset;
+		if (write)
+			memcpy(dev_map + offset, iov[i].iov_base, len);
+		else
+			memcpy(iov[i].iov_base, dev_map + offset, len);
+		offset += len;
+		done += len;
+	}
+	return done;
+}
+
+static ssize_t mmap_preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+	return mmap_copy(iov, iovcnt, offset, 0);
+}
+
+static ssize_t mmap_pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
+	ssize_t want = 0;
+	for (int i = 0; i < iovcnt; i++)
+		want += iov[i].iov_len;
+	ssize_t done = mmap_copy(iov, iovcnt, offset, 1);
+	if (done < want) { // the mapping cannot grow the image
+		errno = ENOSPC;
+		return -1;
+	}
+	return done;
+}
+
+static int mmap_sync(int wait) {
+	return msync(dev_map, dev_map_size, wait ? MS_SYNC : MS_ASYNC);
+}
+
+static const struct dev_backend mmap_backend = {
+	"mmap", 1, mmap_attach, mmap_detach, mmap_preadv, mmap_pwritev, mmap_sync, serial_submit
+};
+
+//io_uring backend: a batch of vectors is queued at once and reaped with one io_uring_enter
+//Set up with raw system calls, falls back to the pread backend if the kernel refuses.
+//If io_uring_enter fails later the ring is torn down and batches go through preadv/pwritev
+#define URING_ENTRIES 64
+
+static struct {
+	int fd;
+	unsigned entries;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+} ring = { .fd = -1 };
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER; // one batch in the ring at a time
+
+static void uring_detach() {
+	if (ring.fd < 0)
+		return;
+	munmap(ring.sqes, ring.sqes_len);
+	if (ring.cq_ptr != ring.sq_ptr)
+		munmap(ring.cq_ptr, ring.cq_len);
+	munmap(ring.sq_ptr, ring.sq_len);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+static int uring_attach() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring.fd < 0) {
+		perror("io_uring_setup failed, using pread");
+		backend = &pread_backend;
+		return backend->attach();
+	}
+	ring.entries = p.sq_entries;
+	ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring.sq_len = ring.cq_len = ring.sq_len > ring.cq_len ? ring.sq_len : ring.cq_len;
+	ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	ring.cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring.sq_ptr :
+		mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sq_ptr == MAP_FAILED || ring.cq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		perror("io_uring mmap failed, using pread");
+		close(ring.fd);
+		ring.fd = -1;
+		backend = &pread_backend;
+		return backend->attach();
+	}
+	ring.sq_tail = (unsigned *)((char *)ring.sq_ptr + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)((char *)ring.sq_ptr + p.sq_off.array);
+	ring.cq_head = (unsigned *)((char *)ring.cq_ptr + p.cq_off.head);
+	ring.cq_tail = (unsigned *)((char *)ring.cq_ptr + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ptr + p.cq_off.cqes);
+	return 0;
+}
+
+//io_uring_enter failed with inflight requests taken by the kernel and not reaped: wait for them
+//so none still uses its buffers, then close the ring, ring_lock held
+static void uring_abandon(int inflight) {
+	while (inflight > 0) {
+		int ret = syscall(__NR_io_uring_enter, ring.fd, 0, inflight, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR)
+			break; // closing the ring cancels whatever is left
+		unsigned head = *ring.cq_head;
+		for (; head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE); head++)
+			inflight--;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	uring_detach();
+	fprintf(stderr, "io_uring: ring closed, using pread\n");
+}
+
+static int uring_submit(struct dev_io *ios, int n) {
+	int retstat = 0;
+	pthread_mutex_lock(&ring_lock);
+	for (int done = 0; done < n; ) {
+		if (ring.fd < 0) { // the ring failed, run the rest of the batch with preadv/pwritev
+			if (serial_run(&pread_backend, ios + done, n - done) < 0)
+				retstat = -1;
+			break;
+		}
+		int batch = (n - done < (int)ring.entries) ? n - done : (int)ring.entries;
+		// Step 1: Queue the whole batch
+		unsigned tail = *ring.sq_tail;
+		for (int k = 0; k < batch; k++) {
+			struct dev_io *io = &ios[done + k];
+			unsigned idx = tail & *ring.sq_mask;
+			struct io_uring_sqe *sqe = &ring.sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = io->write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = diskfile;
+			sqe->addr = (unsigned long)io->iov;
+			sqe->len = io->iovcnt;
+			sqe->off = io->offset;
+			sqe->user_data = done + k;
+			ring.sq_array[idx] = idx;
+			tail++;
+		}
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+		// Step 2: Submit it and wait for all of its completions
+		int submitted = 0, reaped = 0, failed = 0;
+		while (reaped < batch) {
+			int ret = syscall(__NR_io_uring_enter, ring.fd, batch - submitted, batch - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret < 0 && errno != EINTR) {
+				perror("io_uring_enter failed");
+				uring_abandon(submitted - reaped);
+				break; // the whole batch is redone above
+			}
+			if (ret > 0)
+				submitted += ret;
+			unsigned head = *ring.cq_head;
+			while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+				ios[cqe->user_data].res = cqe->res;
+				if (cqe->res < 0)
+					failed = 1;
+				head++;
+				reaped++;
+			}
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		}
+		if (reaped < batch)
+			continue;
+		if (failed)
+			retstat = -1;
+		done += batch;
+	}
+	pthread_mutex_unlock(&ring_lock);
+	return retstat;
+}
+
+static ssize_t uring_io(const struct iovec *iov, int iovcnt, off_t offset, int write) {
+	struct dev_io io = { iov, iovcnt, offset, write, 0 };
+	if (uring_submit(&io, 1) < 0) {
+		if (io.res < 0)
+			errno = -io.res;
+		return -1;
+	}
+	return io.res;
+}
+
+static ssize_t uring_preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+	return uring_io(iov, iovcnt, offset, 0);
+}
+
+static ssize_t uring_pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
+	return uring_io(iov, iovcnt, offset, 1);
+}
+
+static const struct dev_backend uring_backend = {
+	"uring", 0, uring_attach, uring_detach, uring_preadv, uring_pwritev, pread_sync, uring_submit
+};
+
+static const struct dev_backend *backends[] = { &pread_backend, &mmap_backend, &uring_backend };
+static const struct dev_backend *backend = &pread_backend;
+
+//Select the backend by name before dev_init/dev_open, returns -1 if there is no such backend
+int dev_set_backend(const char *name) {
+	for (int i = 0; i < (int)(sizeof(backends) / sizeof(backends[0])); i++) {
+		if (strcmp(backends[i]->name, name) == 0) {
+			backend = backends[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int dev_direct = 0;	// DISKFILE is open with O_DIRECT
+
+//Open DISKFILE with O_DIRECT from the next dev_init/dev_open so the host page cache is bypassed
+void dev_set_direct(int on) {
+	dev_direct = on;
+}
+
+static int dev_iov_aligned(const struct dev_io *io) {
+	if (io->offset % DEV_ALIGN)
+		return 0;
+	for (int k = 0; k < io->iovcnt; k++)
+		if ((uintptr_t)io->iov[k].iov_base % DEV_ALIGN || io->iov[k].iov_len % DEV_ALIGN)
+			return 0;
+	return 1;
+}
+
+//Hand a batch to the backend, under O_DIRECT vectors with unaligned buffers go through
+//an aligned bounce buffer
+static int dev_submit_direct(struct dev_io *ios, int n) {
+	const struct iovec *orig[DEV_BATCH];
+	int origcnt[DEV_BATCH];
+	struct iovec bounce[DEV_BATCH];
+	int retstat = 0;
+	for (int done = 0; done < n; done += DEV_BATCH) {
+		int batch = (n - done < DEV_BATCH) ? n - done : DEV_BATCH;
+		struct dev_io *b = ios + done;
+		// Step 1: Swap every unaligned vector for one aligned buffer
+		for (int k = 0; k < batch; k++) {
+			orig[k] = NULL;
+			if (dev_iov_aligned(&b[k]))
+				continue;
+			size_t len = 0;
+			for (int v = 0; v < b[k].iovcnt; v++)
+				len += b[k].iov[v].iov_len;
+			if (posix_memalign(&bounce[k].iov_base, DEV_ALIGN, len)) {
+				b[k].res = -ENOMEM;
+				retstat = -1;
+				continue;
+			}
+			bounce[k].iov_len = len;
+			if (b[k].write) {
+				char *p = bounce[k].iov_base;
+				for (int v = 0; v < b[k].iovcnt; v++) {
+					memcpy(p, b[k].iov[v].iov_base, b[k].iov[v].iov_len);
+					p += b[k].iov[v].iov_len;
+				}
+			}
+			orig[k] = b[k].iov;
+			origcnt[k] = b[k].iovcnt;
+			b[k].iov = &bounce[k];
+			b[k].iovcnt = 1;
+		}
+		if (backend->submit(b, batch) < 0)
+			retstat = -1;
+		// Step 2: Scatter what was read and put the caller's vectors back
+		for (int k = 0; k < batch; k++) {
+			if (!orig[k])
+				continue;
+			if (!b[k].write && b[k].res > 0) {
+				char *p = bounce[k].iov_base;
+				size_t left = b[k].res;
+				for (int v = 0; v < origcnt[k] && left; v++) {
+					size_t len = orig[k][v].iov_len < left ? orig[k][v].iov_len : left;
+					memcpy(orig[k][v].iov_base, p, len);
+					p += len;
+					left -= len;
+				}
+			}
+			free(bounce[k].iov_base);
+			b[k].iov = orig[k];
+			b[k].iovcnt = origcnt[k];
+		}
+	}
+	return retstat;
+}
+
+//Hand a batch to the backend, every request is accounted with the latency of the whole batch
+static int dev_submit(struct dev_io *ios, int n) {
+	uint64_t start = stats_now();
+	int retstat = dev_direct ? dev_submit_direct(ios, n) : backend->submit(ios, n);
+	for (int k = 0; k < n; k++)
+		stats_op(ios[k].write ? ST_DEV_WRITE : ST_DEV_READ, ios[k].res, start);
+	return retstat;
+}
+
+static ssize_t dev_pread(void *buf, size_t len, off_t offset) {
+	struct iovec iov = { buf, len };
+	struct dev_io io = { &iov, 1, offset, 0, 0 };
+	if (dev_submit(&io, 1) < 0) {
+		errno = -io.res;
+		return -1;
+	}
+	return io.res;
+}
+
+static ssize_t dev_pwrite(const void *buf, size_t len, off_t offset) {
+	struct iovec iov = { (void *)buf, len };
+	struct dev_io io = { &iov, 1, offset, 1, 0 };
+	if (dev_submit(&io, 1) < 0) {
+		errno = -io.res;
+		return -1;
+	}
+	return io.res;
+}
+
+//Open DISKFILE, with O_DIRECT if it was asked for and the file system allows it
+static int dev_open_file(const char *diskfile_path, int flags) {
+	if (dev_direct && backend->uncached) { // mapped pages live in the host page cache anyway
+		fprintf(stderr, "disk_open: O_DIRECT does not apply to the %s backend\n", backend->name);
+		dev_direct = 0;
+	}
+	if (dev_direct) {
+		int fd = open(diskfile_path, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+		if (fd >= 0 || errno != EINVAL)
+			return fd;
+		perror("disk_open: O_DIRECT not supported, using the host page cache");
+		dev_direct = 0;
+	}
+	return open(diskfile_path, flags, S_IRUSR | S_IWUSR);
+}
+
+struct cache_buf {
+	int blkno;			// block held by this buffer, -1 if unused
+	int next;			// next buffer in the same hash chain, -1 ends the chain
+	uint8_t dirty;		// modified since it was last written back
+	uint8_t ref;		// CLOCK reference bit
+	uint8_t pinned;		// hot metadata, never evicted
+	unsigned char *data;
+};
+
+static struct cache_buf *cache = NULL;
+static int *cache_bucket = NULL;	// head buffer index of each hash chain
+static unsigned char **cache_mem = NULL;	// CACHE_BLOCKS buffers, then CACHE_GROW per growth
+static int cache_size = 0;
+static int cache_hold = 0;	// dirty blocks are only written back by bio_checkpoint()
+static int cache_hold_max = 0;	// most dirty blocks held at once
+static int cache_dirty = 0;	// dirty buffers (atomic, bio_dirty() reads it without the lock)
+static int clock_hand = 0;
+static int pinned_count = 0;
+static unsigned long write_gen = 0;	// bumped by writes that bypass the cache
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER; // protects all of the cache state above
+
+//Add count empty buffers to the cache, returns the index of the first or -1
+static int cache_add(int count) {
+	int chunks = cache_size ? 1 + (cache_size - CACHE_BLOCKS) / CACHE_GROW : 0;
+	unsigned char **mem = realloc(cache_mem, (chunks + 1) * sizeof(unsigned char *));
+	if (!mem)
+		return -1;
+	cache_mem = mem;
+	struct cache_buf *c = realloc(cache, (cache_size + count) * sizeof(struct cache_buf));
+	if (!c)
+		return -1;
+	cache = c;
+	if (posix_memalign((void **)&cache_mem[chunks], DEV_ALIGN, (size_t)count * BLOCK_SIZE))
+		return -1;
+	int first = cache_size;
+	for (int i = first; i < first + count; i++) {
+		memset(&cache[i], 0, sizeof(cache[i]));
+		cache[i].blkno = -1;
+		cache[i].next = -1;
+		cache[i].data = cache_mem[chunks] + (size_t)(i - first) * BLOCK_SIZE;
+	}
+	cache_size += count;
+	return first;
+}
+
+static void cache_init() {
+	if (cache)
+		return;
+	cache_bucket = malloc(CACHE_BUCKETS * sizeof(int));
+	if (!cache_bucket || cache_add(CACHE_BLOCKS) < 0) {
+		perror("cache_init failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < CACHE_BUCKETS; i++)
+		cache_bucket[i] = -1;
+	clock_hand = 0;
+	pinned_count = 0;
+}
+
+static void cache_free() {
+	int chunks = cache_size ? 1 + (cache_size - CACHE_BLOCKS) / CACHE_GROW : 0;
+	for (int k = 0; k < chunks; k++)
+		free(cache_mem[k]);
+	free(cache);
+	free(cache_bucket);
+	free(cache_mem);
+	cache = NULL;
+	cache_bucket = NULL;
+	cache_mem = NULL;
+	cache_size = 0;
+	cache_dirty = 0;
+}
+
+static int cache_lookup(int block_num) {
+	for (int i = cache_bucket[block_num % CACHE_BUCKETS]; i != -1; i = cache[i].next)
+		if (cache[i].blkno == block_num)
+			return i;
+	return -1;
+}
+
+static void cache_hash(int i, int block_num) {
+	int *head = &cache_bucket[block_num % CACHE_BUCKETS];
+	cache[i].blkno = block_num;
+	cache[i].next = *head;
+	*head = i;
+}
+
+static void cache_unhash(int i) {
+	int *link = &cache_bucket[cache[i].blkno % CACHE_BUCKETS];
+	while (*link != i)
+		link = &cache[*link].next;
+	*link = cache[i].next;
+	cache[i].blkno = -1;
+	cache[i].next = -1;
+}
+
+static void cache_set_dirty(int i, int dirty) {
+	if (cache[i].dirty != dirty)
+		__atomic_store_n(&cache_dirty, cache_dirty + (dirty ? 1 : -1), __ATOMIC_RELAXED);
+	cache[i].dirty = dirty;
+}
+
+static int cache_writeback(int i) {
+	int retstat = dev_pwrite(cache[i].data, BLOCK_SIZE, (off_t)cache[i].blkno * BLOCK_SIZE);
+	if (retstat < 0) {
+		perror("block_write failed");
+		return retstat;
+	}
+	cache_set_dirty(i, 0);
+	write_gen++;
+	return retstat;
+}
+
+//Pick a buffer to reuse with the CLOCK algorithm, writing it back if dirty
+//Returns -1 if every buffer is pinned, or pinned or dirty while blocks are held
+static int cache_evict() {
+	for (int scanned = 0; scanned < 2 * cache_size; scanned++) {
+		int i = clock_hand;
+		clock_hand = (clock_hand + 1) % cache_size;
+		if (cache[i].pinned || (cache_hold && cache[i].dirty))
+			continue;
+		if (cache[i].blkno == -1)
+			return i;
+		if (cache[i].ref) {
+			cache[i].ref = 0;
+			continue;
+		}
+		if (cache[i].dirty && cache_writeback(i) < 0)
+			continue;
+		cache_unhash(i);
+		return i;
+	}
+	return -1;
+}
+
+//Creates a file of size bytes which is your new emulated disk
+void dev_init(const char* diskfile_path, off_t size) {
     if (diskfile >= 0) {
 		  return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = dev_open_file(diskfile_path, O_CREAT | O_RDWR);
     if (diskfile < 0) {
       perror("disk_open failed");
       exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    if (ftruncate(diskfile, size) < 0) {
+		perror("disk_open failed");
+		exit(EXIT_FAILURE);
+	}
+	if (backend->attach() < 0) {
+		fprintf(stderr, "disk_open failed: %s backend\n", backend->name);
+		exit(EXIT_FAILURE);
+	}
+	cache_init();
 }
 
 //Function to open the disk file
@@ -43,24 +646,64 @@ int dev_open(const char* diskfile_path) {
 		return 0;
     }
     
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = dev_open_file(diskfile_path, O_RDWR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		return -1;
     }
+	if (backend->attach() < 0) {
+		close(diskfile);
+		diskfile = -1;
+		return -1;
+	}
+	cache_init();
 	return 0;
 }
 
 void dev_close() {
     if (diskfile >= 0) {
+		bio_flush();
+		backend->detach();
 		close(diskfile);
+		diskfile = -1;
     }
+	cache_free();
 }
 
-//Read a block from the disk
-int bio_read(const int block_num, void *buf) {
+//Write back dirty blocks and force them to stable storage
+int dev_sync() {
+	if (bio_flush() < 0)
+		return -1;
+	return backend->sync(1);
+}
+
+//Force every write so far to stable storage, dirty cached blocks stay dirty
+int dev_barrier() {
+	return backend->sync(1);
+}
+
+//Read a block through the cache, the caller holds cache_lock
+static int cache_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+	int i = cache_lookup(block_num);
+	if (i != -1) {
+		cache[i].ref = 1;
+		memcpy(buf, cache[i].data, BLOCK_SIZE);
+		stats_count(SC_CACHE_HIT, 1);
+		return BLOCK_SIZE;
+	}
+	stats_count(SC_CACHE_MISS, 1);
+	i = cache_evict();
+	if (i == -1) { // cache full of pinned blocks, go straight to disk
+		retstat = dev_pread(buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+	} else {
+		retstat = dev_pread(cache[i].data, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+		if (retstat > 0) {
+			cache_hash(i, block_num);
+			cache[i].ref = 1;
+			memcpy(buf, cache[i].data, BLOCK_SIZE);
+		}
+	}
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
@@ -70,13 +713,414 @@ int bio_read(const int block_num, void *buf) {
     return retstat;
 }
 
-//Write a block to the disk
-int bio_write(const int block_num, const void *buf) {
-    int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0) {
-		    perror("block_write failed");
-    }
+//Read a block from the disk
+int bio_read(const int block_num, void *buf) {
+	uint64_t start = stats_now();
+	int retstat;
+	if (backend->uncached) {
+		retstat = dev_pread(buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+		if (retstat < BLOCK_SIZE)
+			memset((char *)buf + (retstat > 0 ? retstat : 0), 0, BLOCK_SIZE - (retstat > 0 ? retstat : 0));
+	} else {
+		pthread_mutex_lock(&cache_lock);
+		retstat = cache_read(block_num, buf);
+		pthread_mutex_unlock(&cache_lock);
+	}
+	stats_op(ST_BIO_READ, retstat, start);
+	return retstat;
+}
+
+static int cache_write(const int block_num, const void *buf) {
+    int retstat = BLOCK_SIZE;
+	if (backend->uncached)
+		return dev_pwrite(buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+	pthread_mutex_lock(&cache_lock);
+	int i = cache_lookup(block_num);
+	if (i == -1) {
+		i = cache_evict();
+		if (i == -1 && cache_hold) {
+			// a held block must not reach its place before bio_checkpoint(), so there is no write through
+			if (cache_dirty >= cache_hold_max || (i = cache_add(CACHE_GROW)) == -1) {
+				fprintf(stderr, "block_write failed: %d dirty blocks held\n", cache_dirty);
+				pthread_mutex_unlock(&cache_lock);
+				return -1;
+			}
+		}
+		if (i == -1) { // cache full of pinned blocks, write through
+			retstat = dev_pwrite(buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+			if (retstat < 0) {
+				perror("block_write failed");
+			}
+			pthread_mutex_unlock(&cache_lock);
+			return retstat;
+		}
+		cache_hash(i, block_num);
+	}
+	memcpy(cache[i].data, buf, BLOCK_SIZE);
+	cache_set_dirty(i, 1);
+	cache[i].ref = 1;
+	pthread_mutex_unlock(&cache_lock);
     return retstat;
 }
 
+//Write a block to the cache, it reaches the disk on eviction or bio_flush()
+int bio_write(const int block_num, const void *buf) {
+	uint64_t start = stats_now();
+	int retstat = cache_write(block_num, buf);
+	stats_op(ST_BIO_WRITE, retstat, start);
+	return retstat;
+}
+
+//Read blocks [block_num, block_num + iovcnt), block i lands in iov[i] (BLOCK_SIZE bytes each)
+//Cached blocks are copied from the cache, every run of uncached blocks is one vectored read
+//and the runs are handed to the backend as one batch
+//Uncached blocks are not added to the cache so streaming reads do not evict metadata
+static int cache_readv(const int block_num, const struct iovec *iov, const int iovcnt) {
+	struct dev_io ios[DEV_BATCH];
+	int i = 0;
+	while (i < iovcnt) {
+		// Step 1: Copy cached blocks and collect up to DEV_BATCH runs of uncached ones
+		int nio = 0;
+		pthread_mutex_lock(&cache_lock);
+		while (i < iovcnt && nio < DEV_BATCH) {
+			int c = cache_lookup(block_num + i);
+			if (c != -1) {
+				cache[c].ref = 1;
+				memcpy(iov[i].iov_base, cache[c].data, BLOCK_SIZE);
+				i++;
+				continue;
+			}
+			int len = 1;
+			while (i + len < iovcnt && len < IOV_MAX && cache_lookup(block_num + i + len) == -1)
+				len++;
+			ios[nio++] = (struct dev_io){ iov + i, len, (off_t)(block_num + i) * BLOCK_SIZE, 0, 0 };
+			i += len;
+		}
+		pthread_mutex_unlock(&cache_lock);
+		// Step 2: Read all of the runs in one batch
+		if (nio && dev_submit(ios, nio) < 0) {
+			perror("block_read failed");
+			return -1;
+		}
+		for (int n = 0; n < nio; n++) {
+			for (int k = 0; k < ios[n].iovcnt; k++) { // past the end of the disk reads as zeros
+				ssize_t got = ios[n].res - (ssize_t)k * BLOCK_SIZE;
+				if (got < BLOCK_SIZE)
+					memset((char *)ios[n].iov[k].iov_base + (got > 0 ? got : 0), 0, BLOCK_SIZE - (got > 0 ? got : 0));
+			}
+		}
+	}
+	return iovcnt * BLOCK_SIZE;
+}
+
+//Write blocks [block_num, block_num + iovcnt) from iov[i] straight to disk, IOV_MAX blocks per pwritev
+//Cached copies of these blocks are updated and become clean once the writes succeeded, this also
+//covers blocks read into the cache while the writes were in flight. If a write fails the clean
+//copies are dropped since the disk may hold old or partly written data, dirty ones are still
+//written back later
+static int cache_writev(const int block_num, const struct iovec *iov, const int iovcnt) {
+	struct dev_io ios[DEV_BATCH];
+	int nio = 0;
+	int retstat = iovcnt * BLOCK_SIZE;
+	for (int i = 0; i < iovcnt; i += IOV_MAX) {
+		int len = (iovcnt - i < IOV_MAX) ? iovcnt - i : IOV_MAX;
+		ios[nio++] = (struct dev_io){ iov + i, len, (off_t)(block_num + i) * BLOCK_SIZE, 1, 0 };
+		if ((nio == DEV_BATCH || i + len >= iovcnt) && dev_submit(ios, nio) < 0) {
+			perror("block_write failed");
+			retstat = -1;
+			break;
+		}
+		if (nio == DEV_BATCH)
+			nio = 0;
+	}
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < iovcnt; i++) {
+		int c = cache_lookup(block_num + i);
+		if (c == -1)
+			continue;
+		if (retstat >= 0) {
+			memcpy(cache[c].data, iov[i].iov_base, BLOCK_SIZE);
+			cache_set_dirty(c, 0);
+		} else if (!cache[c].dirty) {
+			if (cache[c].pinned) {
+				cache[c].pinned = 0;
+				pinned_count--;
+			}
+			cache_unhash(c);
+		}
+	}
+	write_gen++;
+	pthread_mutex_unlock(&cache_lock);
+	return retstat;
+}
+
+int bio_readv(const int block_num, const struct iovec *iov, const int iovcnt) {
+	uint64_t start = stats_now();
+	int retstat = cache_readv(block_num, iov, iovcnt);
+	stats_op(ST_BIO_READV, retstat, start);
+	return retstat;
+}
+
+int bio_writev(const int block_num, const struct iovec *iov, const int iovcnt) {
+	uint64_t start = stats_now();
+	int retstat = cache_writev(block_num, iov, iovcnt);
+	stats_op(ST_BIO_WRITEV, retstat, start);
+	return retstat;
+}
+
+//Range versions of bio_readv/bio_writev for one contiguous buffer of count blocks
+#define RANGE_IOVS 64
+
+int bio_read_range(const int block_num, const int count, void *buf) {
+	struct iovec iov[RANGE_IOVS];
+	for (int i = 0; i < count; i += RANGE_IOVS) {
+		int len = (count - i < RANGE_IOVS) ? count - i : RANGE_IOVS;
+		for (int k = 0; k < len; k++) {
+			iov[k].iov_base = (char *)buf + (size_t)(i + k) * BLOCK_SIZE;
+			iov[k].iov_len = BLOCK_SIZE;
+		}
+		if (bio_readv(block_num + i, iov, len) < 0)
+			return -1;
+	}
+	return count * BLOCK_SIZE;
+}
+
+int bio_write_range(const int block_num, const int count, const void *buf) {
+	struct iovec iov[RANGE_IOVS];
+	for (int i = 0; i < count; i += RANGE_IOVS) {
+		int len = (count - i < RANGE_IOVS) ? count - i : RANGE_IOVS;
+		for (int k = 0; k < len; k++) {
+			iov[k].iov_base = (char *)buf + (size_t)(i + k) * BLOCK_SIZE;
+			iov[k].iov_len = BLOCK_SIZE;
+		}
+		if (bio_writev(block_num + i, iov, len) < 0)
+			return -1;
+	}
+	return count * BLOCK_SIZE;
+}
+
+//Zero blocks [block_num, block_num + count) on the disk and in the cache
+//The host file system is asked for a zeroed range first, otherwise zeros are written
+//RANGE_IOVS blocks at a time
+int bio_zero_range(const int block_num, const int count) {
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < cache_size; i++) {
+		if (cache[i].blkno >= block_num && cache[i].blkno < block_num + count) {
+			memset(cache[i].data, 0, BLOCK_SIZE);
+			cache_set_dirty(i, 0);
+		}
+	}
+	write_gen++;
+	pthread_mutex_unlock(&cache_lock);
+	if (fallocate(diskfile, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+			(off_t)block_num * BLOCK_SIZE, (off_t)count * BLOCK_SIZE) == 0)
+		return 0;
+	void *zeros;
+	if (posix_memalign(&zeros, DEV_ALIGN, RANGE_IOVS * BLOCK_SIZE))
+		return -1;
+	memset(zeros, 0, RANGE_IOVS * BLOCK_SIZE);
+	int retstat = 0;
+	for (int i = 0; i < count && retstat == 0; i += RANGE_IOVS) {
+		int len = (count - i < RANGE_IOVS) ? count - i : RANGE_IOVS;
+		if (bio_write_range(block_num + i, len, zeros) < 0)
+			retstat = -1;
+	}
+	free(zeros);
+	return retstat;
+}
+
+//Load blocks [block_num, block_num + count) into the cache ahead of their use, one preadv
+//Blocks that are cached already are skipped, newly loaded blocks are the first to be evicted
+//The blocks are dropped if a write bypassed the cache while they were being read
+int bio_prefetch(const int block_num, const int count) {
+	int n = count < IOV_MAX ? count : IOV_MAX;
+	if (n <= 0 || !cache || diskfile < 0 || backend->uncached)
+		return 0;
+	pthread_mutex_lock(&cache_lock);
+	int first = 0;
+	while (first < n && cache_lookup(block_num + first) != -1)
+		first++;
+	unsigned long gen = write_gen;
+	pthread_mutex_unlock(&cache_lock);
+	if (first == n)
+		return 0;
+	n -= first;
+	unsigned char *buf;
+	if (posix_memalign((void **)&buf, DEV_ALIGN, (size_t)n * BLOCK_SIZE))
+		return -1;
+	ssize_t retstat = dev_pread(buf, (size_t)n * BLOCK_SIZE, (off_t)(block_num + first) * BLOCK_SIZE);
+	if (retstat < 0) {
+		perror("block_prefetch failed");
+		free(buf);
+		return -1;
+	}
+	int loaded = 0;
+	pthread_mutex_lock(&cache_lock);
+	for (int k = 0; write_gen == gen && k < retstat / BLOCK_SIZE; k++) {
+		if (cache_lookup(block_num + first + k) != -1)
+			continue;
+		int i = cache_evict();
+		if (i == -1)
+			break;
+		memcpy(cache[i].data, buf + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+		cache_hash(i, block_num + first + k);
+		cache[i].ref = 0;
+		loaded++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	free(buf);
+	return loaded;
+}
+
+//Keep blocks [block_num, block_num + count) resident in the cache
+//At most half of the cache can be pinned so data blocks still have room
+int bio_pin(const int block_num, const int count) {
+	if (backend->uncached)
+		return 0;
+	unsigned char *tmp;
+	if (posix_memalign((void **)&tmp, DEV_ALIGN, BLOCK_SIZE))
+		return -1;
+	pthread_mutex_lock(&cache_lock);
+	for (int b = block_num; b < block_num + count; b++) {
+		int i = cache_lookup(b);
+		if (i == -1) {
+			if (pinned_count >= CACHE_BLOCKS / 2)
+				break;
+			if (cache_read(b, tmp) <= 0 || (i = cache_lookup(b)) == -1)
+				continue;
+		}
+		if (!cache[i].pinned) {
+			cache[i].pinned = 1;
+			pinned_count++;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	free(tmp);
+	return 0;
+}
+
+static int cmp_blkno(const void *a, const void *b) {
+	return cache[*(const int *)a].blkno - cache[*(const int *)b].blkno;
+}
+
+static int cmp_int(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+//Keep dirty blocks in the cache until bio_checkpoint() so none reaches the disk early,
+//the cache grows if it fills up with them. Once max blocks are dirty further writes of
+//uncached blocks fail, the caller flushes before that. Returns -1 if the backend has no cache
+int bio_hold(int on, int max) {
+	if (on && backend->uncached)
+		return -1;
+	pthread_mutex_lock(&cache_lock);
+	cache_hold = on;
+	cache_hold_max = max;
+	pthread_mutex_unlock(&cache_lock);
+	return 0;
+}
+
+//Store up to max dirty block numbers in blknos in ascending order, returns how many are dirty
+int bio_dirty(int *blknos, int max) {
+	int n = 0;
+	if (!cache)
+		return 0;
+	if (max <= 0)
+		return __atomic_load_n(&cache_dirty, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < cache_size; i++) {
+		if (cache[i].blkno == -1 || !cache[i].dirty)
+			continue;
+		if (n < max)
+			blknos[n] = cache[i].blkno;
+		n++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	qsort(blknos, n < max ? n : max, sizeof(int), cmp_int);
+	return n;
+}
+
+//Write back every dirty block in block order, one vectored write per run of consecutive blocks
+//and all runs submitted to the backend as one batch
+//Held blocks are only written when held is set, otherwise nothing is written and -1 returned
+static int cache_flush(int held) {
+	int ndirty = 0, nio = 0;
+	if (!cache || diskfile < 0)
+		return 0;
+	pthread_mutex_lock(&cache_lock);
+	if (cache_hold && !held && cache_dirty) { // not committed yet, the journal writes them
+		pthread_mutex_unlock(&cache_lock);
+		return -1;
+	}
+	int *dirty = malloc(cache_size * sizeof(int));
+	int *first = malloc(cache_size * sizeof(int));	// index in dirty of each run
+	struct iovec *iov = malloc(cache_size * sizeof(struct iovec));
+	struct dev_io *ios = malloc(cache_size * sizeof(struct dev_io));
+	if (!dirty || !first || !iov || !ios) {
+		pthread_mutex_unlock(&cache_lock);
+		free(dirty);
+		free(first);
+		free(iov);
+		free(ios);
+		return -1;
+	}
+	for (int i = 0; i < cache_size; i++)
+		if (cache[i].blkno != -1 && cache[i].dirty)
+			dirty[ndirty++] = i;
+	qsort(dirty, ndirty, sizeof(int), cmp_blkno);
+	// Step 1: One vectored write per run of consecutive blocks
+	for (int run = 0; run < ndirty; ) {
+		int len = 1;
+		while (run + len < ndirty && len < IOV_MAX &&
+				cache[dirty[run + len]].blkno == cache[dirty[run]].blkno + len)
+			len++;
+		for (int k = 0; k < len; k++) {
+			iov[run + k].iov_base = cache[dirty[run + k]].data;
+			iov[run + k].iov_len = BLOCK_SIZE;
+		}
+		first[nio] = run;
+		ios[nio++] = (struct dev_io){ iov + run, len, (off_t)cache[dirty[run]].blkno * BLOCK_SIZE, 1, 0 };
+		run += len;
+	}
+	// Step 2: Hand every run to the backend as one batch
+	int retstat = 0;
+	if (nio && dev_submit(ios, nio) < 0) {
+		perror("block_flush failed");
+		retstat = -1;
+	}
+	for (int n = 0; n < nio; n++)
+		if (ios[n].res >= 0)
+			for (int k = 0; k < ios[n].iovcnt; k++)
+				cache_set_dirty(dirty[first[n] + k], 0);
+	pthread_mutex_unlock(&cache_lock);
+	free(dirty);
+	free(first);
+	free(iov);
+	free(ios);
+	if (backend->sync(0) < 0) // start write-back of blocks the backend holds itself
+		retstat = -1;
+	return retstat;
+}
+
+//Write back the dirty blocks, refused while they are held for the journal
+int bio_flush() {
+	return cache_flush(0);
+}
+
+//Write back the held blocks once the journal has committed them
+int bio_checkpoint() {
+	return cache_flush(1);
+}
+
+//Snapshot of the block I/O counters, callers diff two snapshots to measure an operation
+void bio_get_stats(struct bio_stats *st) {
+	struct stats all;
+	stats_sum(&all);
+	st->reads = all.op[ST_BIO_READ].calls;
+	st->writes = all.op[ST_BIO_WRITE].calls;
+	st->hits = all.count[SC_CACHE_HIT];
+	st->dev_reads = all.op[ST_DEV_READ].calls;
+	st->dev_writes = all.op[ST_DEV_WRITE].calls;
+	st->dev_read_bytes = all.op[ST_DEV_READ].bytes;
+	st->dev_write_bytes = all.op[ST_DEV_WRITE].bytes;
+}
@@ -8,12 +8,42 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
-#define BLOCK_SIZE 4096
+#include <sys/types.h>
+#include <sys/uio.h>
 
-void dev_init(const char* diskfile_path);
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 4096		// build with -DBLOCK_SIZE=<bytes> for another block size
+#endif
+
+//Block I/O counters since the program started, summed from stats_sum()
+//Device reads and writes are the vectored requests actually handed to the backend
+struct bio_stats {
+	unsigned long reads, writes;		// bio_read and bio_write calls
+	unsigned long hits;					// cached reads that did not go to the device
+	unsigned long dev_reads, dev_writes;
+	unsigned long dev_read_bytes, dev_write_bytes;
+};
+
+int dev_set_backend(const char *name);
+void dev_set_direct(int on);
+void dev_init(const char* diskfile_path, off_t size);
 int dev_open(const char* diskfile_path);
 void dev_close();
+int dev_sync();
+int dev_barrier();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int block_num, const struct iovec *iov, const int iovcnt);
+int bio_writev(const int block_num, const struct iovec *iov, const int iovcnt);
+int bio_read_range(const int block_num, const int count, void *buf);
+int bio_write_range(const int block_num, const int count, const void *buf);
+int bio_zero_range(const int block_num, const int count);
+int bio_prefetch(const int block_num, const int count);
+int bio_pin(const int block_num, const int count);
+int bio_flush();
+int bio_checkpoint();
+int bio_hold(int on, int max);
+int bio_dirty(int *blknos, int max);
+void bio_get_stats(struct bio_stats *st);
 
 #endif
@@ -0,0 +1,423 @@
+/*
+ *	Tiny File System
+ *	File:	fsck.c
+ *
+ *	Consistency checker. rufs.c is compiled into this file with RUFS_NO_MAIN, the image
+ *	is opened (and its journal replayed) by rufs_init like a mount.
+ *	Pass 1 walks the directory tree from the root, pass 2 reads every allocated inode, checks
+ *	its link count and collects the blocks it maps, both spread over worker threads. Pass 3
+ *	cross-checks the results against the block and inode bitmaps and the group descriptors.
+ *	With -r the bitmaps, free counts and link counts are rewritten from what was found and
+ *	inodes no directory reaches are freed.
+ *
+ *	usage: rufs_fsck [-r] [-v] [-j threads] [diskfile]
+ *	Exit status: 0 clean, 1 errors repaired, 4 errors left, 8 operational error
+ */
+
+#define RUFS_NO_MAIN
+#include "rufs.c"
+
+#include <stdarg.h>
+
+#define FSCK_THREADS 8
+#define FSCK_REPORT 20		// problems of one kind printed before they are only counted
+
+static int repair = 0;
+static int verbose = 0;
+static int nthreads = 0;
+
+static int *refs;			// directory entries naming each inode, "." and ".." excluded (atomic)
+static unsigned char *reached;	// inode reached from the root (atomic)
+static unsigned char *used;	// block bitmap built from metadata and inode block maps (atomic)
+static int *group_dirs;		// directories kept in each group (atomic)
+static int errors = 0;		// inconsistencies found (atomic)
+
+static void problem(int *count, const char *fmt, ...) {
+	__atomic_add_fetch(&errors,1,__ATOMIC_RELAXED);
+	if(__atomic_add_fetch(count,1,__ATOMIC_RELAXED) > FSCK_REPORT && !verbose)
+		return;
+	va_list ap;
+	va_start(ap,fmt);
+	flockfile(stdout);
+	vprintf(fmt,ap);
+	putchar('\n');
+	funlockfile(stdout);
+	va_end(ap);
+}
+
+static int bad_entries, bad_inodes, bad_blocks, dup_blocks, bad_links;
+
+// Set bit i of b, returns its old value
+static int test_and_set(unsigned char *b, int i) {
+	unsigned char mask = 1 << (i & 7);
+	return (__atomic_fetch_or(&b[i / 8],mask,__ATOMIC_RELAXED) & mask) != 0;
+}
+
+static int test_bit(unsigned char *b, int i) {
+	return (__atomic_load_n(&b[i / 8],__ATOMIC_RELAXED) >> (i & 7)) & 1;
+}
+
+static int inode_allocated(int ino) {
+	return get_bitmap(groups[inode_group(ino)].imap,ino % sb.inodes_per_group);
+}
+
+/*
+ * Work queue: directories in pass 1, inode numbers in pass 2
+ * Pass 1 grows it as subdirectories are found, a worker only quits once it is empty and
+ * no other worker is still busy with a directory
+ */
+static struct {
+	int *items;
+	int head, tail, cap;
+	int busy;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static int queue_push(int item) {
+	pthread_mutex_lock(&queue.lock);
+	if(queue.tail == queue.cap) {
+		int cap = queue.cap ? 2 * queue.cap : 1024;
+		int *p = realloc(queue.items,cap * sizeof(int));
+		if(!p) {
+			pthread_mutex_unlock(&queue.lock);
+			return -ENOMEM;
+		}
+		queue.items = p;
+		queue.cap = cap;
+	}
+	queue.items[queue.tail++] = item;
+	pthread_cond_signal(&queue.cond);
+	pthread_mutex_unlock(&queue.lock);
+	return 0;
+}
+
+// Returns the next item, or -1 once the queue is drained for good
+static int queue_pop() {
+	pthread_mutex_lock(&queue.lock);
+	while(queue.head == queue.tail && queue.busy)
+		pthread_cond_wait(&queue.cond,&queue.lock);
+	int item = -1;
+	if(queue.head < queue.tail) {
+		item = queue.items[queue.head++];
+		queue.busy++;
+	} else {
+		pthread_cond_broadcast(&queue.cond);
+	}
+	pthread_mutex_unlock(&queue.lock);
+	return item;
+}
+
+static void queue_done() {
+	pthread_mutex_lock(&queue.lock);
+	if(--queue.busy == 0 && queue.head == queue.tail)
+		pthread_cond_broadcast(&queue.cond);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+static void queue_reset() {
+	queue.head = queue.tail = queue.busy = 0;
+}
+
+static void run_workers(void *(*fn)(void *)) {
+	pthread_t threads[FSCK_THREADS];
+	int started = 0;
+	while(started < nthreads && pthread_create(&threads[started],NULL,fn,NULL) == 0)
+		started++;
+	if(started == 0)
+		fn(NULL);
+	for(int i = 0; i < started; i++)
+		pthread_join(threads[i],NULL);
+}
+
+/*
+ * Pass 1: directory tree
+ */
+struct dir_ctx {
+	int ino;
+};
+
+// dir_walk callback, counts the references of every entry and queues new subdirectories
+static int check_dir_block(unsigned char *block, int packed, void *arg) {
+	struct dir_ctx *ctx = arg;
+	struct dirent dirent;
+	int pos = 0;
+	while(dblk_next(block,packed,&pos,&dirent) >= 0) {
+		int dot = !strcmp(dirent.name,".") || !strcmp(dirent.name,"..");
+		if(dirent.ino >= sb.max_inum) {
+			problem(&bad_entries,"directory %d: entry '%s' has inode %d out of range",ctx->ino,dirent.name,dirent.ino);
+			continue;
+		}
+		if(!strcmp(dirent.name,".") && dirent.ino != ctx->ino)
+			problem(&bad_entries,"directory %d: '.' names inode %d",ctx->ino,dirent.ino);
+		if(dot)
+			continue;
+		if(!inode_allocated(dirent.ino)) {
+			problem(&bad_entries,"directory %d: entry '%s' names free inode %d",ctx->ino,dirent.name,dirent.ino);
+			continue;
+		}
+		__atomic_add_fetch(&refs[dirent.ino],1,__ATOMIC_RELAXED);
+		struct inode inode;
+		if(readi(dirent.ino,&inode))
+			return -EIO;
+		if(S_ISDIR(inode.vstat.st_mode) && !test_and_set(reached,dirent.ino) && queue_push(dirent.ino))
+			return -ENOMEM;
+		if(!S_ISDIR(inode.vstat.st_mode))
+			test_and_set(reached,dirent.ino);
+	}
+	return 0;
+}
+
+static void *dir_main(void *arg) {
+	int ino;
+	while((ino = queue_pop()) != -1) {
+		struct inode dir;
+		struct dir_ctx ctx = { ino };
+		if(readi(ino,&dir) || dir_walk(&dir,check_dir_block,&ctx))
+			problem(&bad_inodes,"directory %d: unreadable",ino);
+		queue_done();
+	}
+	return NULL;
+}
+
+/*
+ * Pass 2: block maps
+ */
+static void claim(int ino, int blkno) {
+	if(blkno <= 0 || blkno >= sb.max_dnum) {
+		problem(&bad_blocks,"inode %d: block %d out of range",ino,blkno);
+		return;
+	}
+	if(test_and_set(used,blkno))
+		problem(&dup_blocks,"inode %d: block %d is also used elsewhere",ino,blkno);
+}
+
+static void claim_extents(int ino, const struct extent *ext, int n) {
+	for(int i = 0; i < n; i++) {
+		if(ext[i].pblk == 0 || ext[i].pblk >= sb.max_dnum || ext[i].len > sb.max_dnum - ext[i].pblk) {
+			problem(&bad_blocks,"inode %d: extent %u+%u out of range",ino,ext[i].pblk,ext[i].len);
+			continue;
+		}
+		for(uint32_t k = 0; k < ext[i].len; k++)
+			claim(ino,ext[i].pblk + k);
+	}
+}
+
+// Reads pointer block blkno and claims every block it points at, or the pointer blocks
+// below it when depth is 1
+static void claim_ptrs(int ino, int blkno, int depth) {
+	int ptrs[PTRS_PER_BLOCK];
+	claim(ino,blkno);
+	if(blkno <= 0 || blkno >= sb.max_dnum || bio_read(blkno,ptrs) <= 0)
+		return;
+	for(int i = 0; i < PTRS_PER_BLOCK; i++) {
+		if(!ptrs[i])
+			continue;
+		if(depth)
+			claim_ptrs(ino,ptrs[i],0);
+		else
+			claim(ino,ptrs[i]);
+	}
+}
+
+// Claims the blocks under extent tree node eh, and the tree blocks themselves
+static void claim_node(int ino, const struct extent_header *eh) {
+	const struct extent *ext = (const struct extent *)(eh + 1);
+	if(eh->depth == 0) {
+		claim_extents(ino,ext,eh->entries);
+		return;
+	}
+	unsigned char node[BLOCK_SIZE];
+	for(int i = 0; i < eh->entries; i++) {
+		claim(ino,ext[i].pblk);
+		if(ext[i].pblk >= sb.max_dnum || bio_read(ext[i].pblk,node) <= 0)
+			continue;
+		struct extent_header *ch = (struct extent_header *)node;
+		if(ch->magic != EXTENT_MAGIC || ch->entries > EXTENTS_PER_BLOCK || ch->depth != eh->depth - 1) {
+			problem(&bad_inodes,"inode %d: bad extent tree block %d",ino,ext[i].pblk);
+			continue;
+		}
+		claim_node(ino,ch);
+	}
+}
+
+static void claim_inode(struct inode *inode) {
+	const int ino = inode->ino;
+	if(!(inode->type & RUFS_EXTENTS_FL)) {
+		for(int i = 0; i < DIRECT_PTRS; i++)
+			if(inode->direct_ptr[i])
+				claim(ino,inode->direct_ptr[i]);
+		for(int i = 0; i <= SINGLE_INDIRECT; i++)
+			if(inode->indirect_ptr[i])
+				claim_ptrs(ino,inode->indirect_ptr[i],i == SINGLE_INDIRECT);
+		return;
+	}
+	if(inode->eh.magic != EXTENT_MAGIC || inode->eh.entries > EXTENTS_PER_INODE || inode->eh.depth > EXTENT_MAX_DEPTH) {
+		problem(&bad_inodes,"inode %d: bad extent tree root",ino);
+		return;
+	}
+	claim_node(ino,&inode->eh);
+}
+
+// Directories have one parent (the root none) and a link count of 2, files one per entry
+static void check_links(struct inode *inode) {
+	const int ino = inode->ino, dir = S_ISDIR(inode->vstat.st_mode);
+	if(dir && refs[ino] != (ino == 0 ? 0 : 1))
+		problem(&bad_links,"directory %d: named by %d entries",ino,refs[ino]);
+	uint32_t want = dir ? 2 : refs[ino];
+	if(inode->link == want && inode->vstat.st_nlink == want)
+		return;
+	problem(&bad_links,"inode %d: link count %u, found %u",ino,inode->link,want);
+	if(repair) {
+		inode->link = want;
+		inode->vstat.st_nlink = want;
+		writei(ino,inode);
+	}
+}
+
+static void *inode_main(void *arg) {
+	int ino;
+	while((ino = queue_pop()) != -1) {
+		struct inode inode;
+		if(readi(ino,&inode)) {
+			problem(&bad_inodes,"inode %d: unreadable",ino);
+		} else if(!inode.valid || inode.ino != ino) {
+			problem(&bad_inodes,"inode %d: allocated but not valid",ino);
+		} else if(!test_bit(reached,ino)) {
+			// unreachable, reported by pass 3 and with -r freed along with its blocks
+			if(!repair) {
+				claim_inode(&inode);
+				if(S_ISDIR(inode.vstat.st_mode))
+					__atomic_add_fetch(&group_dirs[inode_group(ino)],1,__ATOMIC_RELAXED);
+			}
+		} else {
+			claim_inode(&inode);
+			check_links(&inode);
+			if(S_ISDIR(inode.vstat.st_mode))
+				__atomic_add_fetch(&group_dirs[inode_group(ino)],1,__ATOMIC_RELAXED);
+		}
+		queue_done();
+	}
+	return NULL;
+}
+
+/*
+ * Pass 3: compare with the bitmaps and descriptors
+ */
+static void check_groups() {
+	static int bad_bmap, bad_imap, bad_counts;
+	for(int g = 0; g < sb.groups; g++) {
+		struct group *gr = &groups[g];
+		const int start = group_start(g), nblocks = group_blocks(g);
+		uint32_t free_blocks = 0, free_inodes = 0, dirs = group_dirs[g];
+		for(int i = 0; i < nblocks; i++) {
+			int in_use = test_bit(used,start + i);
+			free_blocks += !in_use;
+			if(in_use == get_bitmap(gr->bmap,i))
+				continue;
+			problem(&bad_bmap,"block %d: bitmap says %s, it is %s",start + i,
+				in_use ? "free" : "used",in_use ? "in use" : "unreferenced");
+			if(repair) {
+				if(in_use)
+					set_bitmap(gr->bmap,i);
+				else
+					unset_bitmap(gr->bmap,i);
+				group_mark_dirty(&gr->bmap_dirty);
+			}
+		}
+		for(int i = 0; i < sb.inodes_per_group; i++) {
+			const int ino = g * sb.inodes_per_group + i;
+			int allocated = get_bitmap(gr->imap,i), live = test_bit(reached,ino);
+			if(allocated && !live) {
+				problem(&bad_imap,"inode %d: allocated but not reachable from the root",ino);
+				if(repair) {
+					unset_bitmap(gr->imap,i);
+					group_mark_dirty(&gr->imap_dirty);
+					allocated = 0;
+				}
+			}
+			free_inodes += !allocated;
+		}
+		if(gr->gd.free_blocks != free_blocks || gr->gd.free_inodes != free_inodes || gr->gd.used_dirs != dirs) {
+			problem(&bad_counts,"group %d: counts %u/%u/%u free blocks/free inodes/dirs, found %u/%u/%u",g,
+				gr->gd.free_blocks,gr->gd.free_inodes,gr->gd.used_dirs,free_blocks,free_inodes,dirs);
+			if(repair) {
+				gr->gd.free_blocks = free_blocks;
+				gr->gd.free_inodes = free_inodes;
+				gr->gd.used_dirs = dirs;
+				gdt_dirty = 1;
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int c;
+	while((c = getopt(argc,argv,"rvj:")) != -1) {
+		switch(c) {
+		case 'r': repair = 1; break;
+		case 'v': verbose = 1; break;
+		case 'j': nthreads = atoi(optarg); break;
+		default:
+			fprintf(stderr,"usage: rufs_fsck [-r] [-v] [-j threads] [diskfile]\n");
+			return 8;
+		}
+	}
+	if(optind < argc)
+		snprintf(diskfile_path,PATH_MAX,"%s",argv[optind]);
+	else if(getcwd(diskfile_path,PATH_MAX - 16))
+		strcat(diskfile_path,"/DISKFILE");
+	if(access(diskfile_path,R_OK | W_OK)) {
+		perror(diskfile_path);
+		return 8;
+	}
+	if(nthreads <= 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu < 1 ? 1 : ncpu;
+	}
+	if(nthreads > FSCK_THREADS)
+		nthreads = FSCK_THREADS;
+
+	// Step 1: Open the image like a mount, without background write-back or readahead
+	rufs_opts.commit = 0;
+	rufs_opts.readahead = 0;
+	rufs_ope.init(NULL);
+	refs = calloc(sb.max_inum,sizeof(int));
+	reached = calloc(sb.max_inum / 8 + 1,1);
+	used = calloc(sb.max_dnum / 8 + 1,1);
+	group_dirs = calloc(sb.groups,sizeof(int));
+	if(!refs || !reached || !used || !group_dirs)
+		return 8;
+	// metadata: superblock, descriptors, bitmaps, inode tables and the journal
+	for(int g = 0; g < sb.groups; g++)
+		for(int b = group_start(g); b < group_first_data(g) + (g == 0 ? (int)sb.journal_blocks : 0); b++)
+			test_and_set(used,b);
+
+	// Step 2: Pass 1, everything reachable from the root
+	if(!inode_allocated(0)) {
+		printf("root inode is not allocated\n");
+		rufs_ope.destroy(NULL);
+		return 4;
+	}
+	test_and_set(reached,0);
+	queue_push(0);
+	run_workers(dir_main);
+
+	// Step 3: Pass 2, the blocks of every allocated inode
+	queue_reset();
+	for(int ino = 0; ino < sb.max_inum; ino++)
+		if(inode_allocated(ino) && queue_push(ino))
+			return 8;
+	run_workers(inode_main);
+
+	// Step 4: Pass 3, cross-check and repair
+	check_groups();
+	if(verbose)
+		printf("%d groups, %d inodes, %d blocks checked with %d threads\n",sb.groups,sb.max_inum,sb.max_dnum,nthreads);
+	rufs_ope.destroy(NULL); // writes back what was repaired
+	free(queue.items);
+	if(errors == 0)
+		return 0;
+	printf("%d problems%s\n",errors,repair ? ", repaired" : "");
+	return repair ? 1 : 4;
+}
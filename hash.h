@@ -0,0 +1,27 @@
+/*
+ *  Copyright (C) 2024 CS416/CS518 Rutgers CS
+ *	Tiny File System
+ *	File:	hash.h
+ *
+ */
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * FNV-1a, used for the dentry cache buckets, directory index hashes and journal checksums
+ * Start from FNV1A_INIT, or from a previous result to continue over more bytes
+ */
+#define FNV1A_INIT 2166136261u
+
+static inline uint32_t fnv1a(uint32_t h, const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+#endif
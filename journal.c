@@ -0,0 +1,158 @@
+/*
+ *  Copyright (C) 2024 CS416/CS518 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	journal.c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "block.h"
+#include "hash.h"
+#include "journal.h"
+
+//Journal region and the header of its last transaction
+static int journal_start = -1;
+static int journal_blocks = 0;
+static struct journal_header jh;
+
+//Blocks taking the block numbers of a count block transaction
+static int list_blocks(int count) {
+	return (count * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static int header_write() {
+	unsigned char block[BLOCK_SIZE];
+	memset(block, 0, BLOCK_SIZE);
+	memcpy(block, &jh, sizeof(jh));
+	return bio_write_range(journal_start, 1, block) < 0 ? -1 : 0;
+}
+
+//Most blocks one transaction can hold
+int journal_capacity() {
+	int n = journal_blocks - 1;
+	return n - list_blocks(n);
+}
+
+//Set up an empty journal in blocks [start, start + nblocks)
+int journal_format(int start, int nblocks) {
+	journal_start = start;
+	journal_blocks = nblocks;
+	memset(&jh, 0, sizeof(jh));
+	jh.magic = JOURNAL_MAGIC;
+	jh.clean = 1;
+	return header_write();
+}
+
+//Use the journal in blocks [start, start + nblocks), call journal_replay() next
+int journal_open(int start, int nblocks) {
+	unsigned char block[BLOCK_SIZE];
+	journal_start = start;
+	journal_blocks = nblocks;
+	if (bio_read_range(start, 1, block) < 0)
+		return -1;
+	memcpy(&jh, block, sizeof(jh));
+	if (jh.magic != JOURNAL_MAGIC)
+		return journal_format(start, nblocks);
+	return 0;
+}
+
+/*
+ * Write a committed transaction that did not reach its place, returns the blocks replayed
+ * A transaction whose checksum does not match never committed and is skipped
+ */
+int journal_replay() {
+	if (jh.clean || jh.count == 0)
+		return 0;
+	if ((int)jh.count > journal_capacity())
+		return -1;
+	// Step 1: Read the block numbers and the copies back and check them
+	int nlist = list_blocks(jh.count);
+	unsigned char *log = malloc((size_t)(nlist + jh.count) * BLOCK_SIZE);
+	if (!log)
+		return -1;
+	if (bio_read_range(journal_start + 1, nlist + jh.count, log) < 0) {
+		free(log);
+		return -1;
+	}
+	int replayed = 0;
+	if (fnv1a(FNV1A_INIT, log, (size_t)(nlist + jh.count) * BLOCK_SIZE) == jh.csum) {
+		// Step 2: Write every copy in place
+		const uint32_t *blknos = (const uint32_t *)log;
+		for (uint32_t i = 0; i < jh.count; i++)
+			if (bio_write(blknos[i], log + (size_t)(nlist + i) * BLOCK_SIZE) <= 0) {
+				free(log);
+				return -1;
+			}
+		if (bio_checkpoint() < 0 || dev_barrier() < 0) {
+			free(log);
+			return -1;
+		}
+		replayed = jh.count;
+	}
+	free(log);
+	// Step 3: The journal is empty again
+	jh.clean = 1;
+	if (header_write() < 0)
+		return -1;
+	return replayed;
+}
+
+/*
+ * Write every dirty block of the block cache as one transaction, then in place
+ * The caller makes sure no operation is half done and nothing else dirties blocks meanwhile
+ */
+int journal_commit() {
+	// Step 1: Collect the dirty blocks
+	int count = bio_dirty(NULL, 0);
+	if (count == 0)
+		return 0;
+	if (count > journal_capacity()) { // the blocks stay dirty, writing them in place could tear them
+		fprintf(stderr, "journal: %d blocks do not fit in one transaction\n", count);
+		return -1;
+	}
+	int nlist = list_blocks(count);
+	unsigned char *log = calloc(nlist + count, BLOCK_SIZE);
+	if (!log)
+		return -1;
+	int *blknos = malloc(count * sizeof(int));
+	if (!blknos || bio_dirty(blknos, count) != count) {
+		free(blknos);
+		free(log);
+		return -1;
+	}
+	// Step 2: Write the block numbers and a copy of each block to the log
+	uint32_t *list = (uint32_t *)log;
+	for (int i = 0; i < count; i++) {
+		list[i] = blknos[i];
+		if (bio_read(blknos[i], log + (size_t)(nlist + i) * BLOCK_SIZE) <= 0)
+			goto fail;
+	}
+	if (bio_write_range(journal_start + 1, nlist + count, log) < 0 || dev_barrier() < 0)
+		goto fail;
+	// Step 3: The transaction is committed once its header is stable
+	jh.seq++;
+	jh.count = count;
+	jh.csum = fnv1a(FNV1A_INIT, log, (size_t)(nlist + count) * BLOCK_SIZE);
+	jh.clean = 0;
+	if (header_write() < 0 || dev_barrier() < 0)
+		goto fail;
+	// Step 4: Write the blocks in place, replay repeats this after a crash
+	if (bio_checkpoint() < 0 || dev_barrier() < 0)
+		goto fail;
+	jh.clean = 1;
+	header_write(); // until this lands the same blocks are replayed again
+	free(blknos);
+	free(log);
+	return 0;
+fail:
+	perror("journal_commit failed");
+	free(blknos);
+	free(log);
+	return -1;
+}
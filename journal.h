@@ -0,0 +1,33 @@
+/*
+ *  Copyright (C) 2024 CS416/CS518 Rutgers CS
+ *	Tiny File System
+ *	File:	journal.h
+ *
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+
+/*
+ * Metadata journal: a header block, then the block numbers of the transaction,
+ * then a copy of each block. The header is written last and commits the transaction.
+ */
+#define JOURNAL_MAGIC 0x4A524E4C
+
+struct journal_header {
+	uint32_t	magic;				/* JOURNAL_MAGIC */
+	uint32_t	seq;				/* transaction sequence number */
+	uint32_t	count;				/* blocks in the transaction */
+	uint32_t	csum;				/* checksum of the block numbers and copies */
+	uint32_t	clean;				/* the transaction is written in place */
+};
+
+int journal_format(int start, int nblocks);
+int journal_open(int start, int nblocks);
+int journal_replay();
+int journal_commit();
+int journal_capacity();
+
+#endif
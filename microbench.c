@@ -0,0 +1,228 @@
+/*
+ *	Tiny File System
+ *	File:	microbench.c
+ *
+ *	In-process microbenchmarks of the rufs hot paths, no FUSE mount involved.
+ *	rufs.c is compiled into this file with RUFS_NO_MAIN so its static routines are
+ *	callable, the file system runs on a fresh temporary DISKFILE.
+ *	Every benchmark prints one JSON line with ns/op and the block I/O done per op.
+ *
+ *	usage: microbench [-n iters] [-e entries] [-D depth] [-s file_mb] [-r seed] [-d diskfile]
+ */
+
+#define RUFS_NO_MAIN
+#include "rufs.c"
+
+#include <time.h>
+
+static int iters = 20000;		// operations per benchmark
+static int n_entries = 500;		// files in the dir_find directory
+static int depth = 16;			// components in the deep path
+static int file_mb = 8;			// file used by rufs_read/rufs_write
+static unsigned seed = 1;
+
+static uint64_t t_begin;
+static struct bio_stats s_begin;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void die(const char *what, int res) {
+	fprintf(stderr, "microbench: %s failed (%d)\n", what, res);
+	exit(1);
+}
+
+static void bench_begin() {
+	bio_get_stats(&s_begin);
+	t_begin = now_ns();
+}
+
+static void bench_end(const char *name, int ops) {
+	uint64_t ns = now_ns() - t_begin;
+	struct bio_stats s;
+	bio_get_stats(&s);
+	printf("{\"op\":\"%s\",\"ops\":%d,\"ns_per_op\":%.1f,\"bio_reads_per_op\":%.3f,"
+		"\"bio_writes_per_op\":%.3f,\"cache_hits_per_op\":%.3f,\"dev_reads_per_op\":%.3f,"
+		"\"dev_writes_per_op\":%.3f}\n",
+		name, ops, (double)ns / ops,
+		(double)(s.reads - s_begin.reads) / ops,
+		(double)(s.writes - s_begin.writes) / ops,
+		(double)(s.hits - s_begin.hits) / ops,
+		(double)(s.dev_reads - s_begin.dev_reads) / ops,
+		(double)(s.dev_writes - s_begin.dev_writes) / ops);
+	fflush(stdout);
+}
+
+static void bench_alloc() {
+	// Allocate as many blocks as the disk allows up to iters, then give them back
+	int n = iters < sb.max_dnum / 2 ? iters : sb.max_dnum / 2;
+	int *blknos = malloc(n * sizeof(int));
+	if(!blknos)
+		die("malloc", -ENOMEM);
+	bench_begin();
+	for(int i = 0; i < n; i++)
+		if((blknos[i] = get_avail_blkno(-1)) < 0)
+			die("get_avail_blkno", blknos[i]);
+	bench_end("get_avail_blkno", n);
+	for(int i = 0; i < n; i++)
+		release_blkno(blknos[i]);
+	free(blknos);
+}
+
+static void bench_dir() {
+	struct fuse_file_info fi = {0};
+	struct inode dir;
+	struct dirent dirent;
+	char path[64], name[32];
+	int res;
+
+	// Step 1: One directory with n_entries files
+	if((res = rufs_ope.mkdir("/dir", 0755)))
+		die("mkdir", res);
+	for(int i = 0; i < n_entries; i++) {
+		snprintf(path, sizeof(path), "/dir/f%d", i);
+		if((res = rufs_ope.create(path, 0644, &fi)))
+			die("create", res);
+		rufs_ope.release(path, &fi);
+	}
+	if((res = get_node_by_path("/dir", 0, &dir)))
+		die("get_node_by_path", res);
+
+	// Step 2: dir_find of random names, bypassing the dentry cache
+	srand(seed);
+	bench_begin();
+	for(int i = 0; i < iters; i++) {
+		int len = snprintf(name, sizeof(name), "f%d", rand() % n_entries);
+		if((res = dir_find(dir.ino, name, len, &dirent)))
+			die("dir_find", res);
+	}
+	bench_end("dir_find", iters);
+
+	// Step 3: readi and writei of the inodes just created
+	struct inode inode;
+	srand(seed);
+	bench_begin();
+	for(int i = 0; i < iters; i++)
+		if((res = readi(dir.ino + 1 + rand() % n_entries, &inode)))
+			die("readi", res);
+	bench_end("readi", iters);
+	srand(seed);
+	bench_begin();
+	for(int i = 0; i < iters; i++) {
+		uint16_t ino = dir.ino + 1 + rand() % n_entries;
+		if((res = readi(ino, &inode)) || (res = writei(ino, &inode)))
+			die("writei", res);
+	}
+	bench_end("readi+writei", iters);
+}
+
+static void bench_path() {
+	struct inode inode;
+	char path[PATH_MAX];
+	int len = 0, res;
+
+	for(int i = 0; i < depth; i++) {
+		len += snprintf(path + len, sizeof(path) - len, "/d%d", i);
+		if((res = rufs_ope.mkdir(path, 0755)))
+			die("mkdir", res);
+	}
+
+	// Warm lookups are dentry cache hits, cold ones search every directory on the way
+	bench_begin();
+	for(int i = 0; i < iters; i++)
+		if((res = get_node_by_path(path, 0, &inode)))
+			die("get_node_by_path", res);
+	bench_end("get_node_by_path", iters);
+	int cold = iters / 10 ? iters / 10 : 1;
+	bench_begin();
+	for(int i = 0; i < cold; i++) {
+		dcache_init();
+		if((res = get_node_by_path(path, 0, &inode)))
+			die("get_node_by_path", res);
+	}
+	bench_end("get_node_by_path_cold", cold);
+}
+
+static void bench_rw() {
+	struct fuse_file_info fi = {0};
+	char buf[BLOCK_SIZE];
+	int nblocks = file_mb * (1024 * 1024 / BLOCK_SIZE), res;
+
+	if((res = rufs_ope.create("/file", 0644, &fi)))
+		die("create", res);
+	memset(buf, 0x61, BLOCK_SIZE);
+	bench_begin();
+	for(int i = 0; i < nblocks; i++)
+		if((res = rufs_ope.write(NULL, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE, &fi)) != BLOCK_SIZE)
+			die("rufs_write", res);
+	bench_end("rufs_write_seq", nblocks);
+	rufs_ope.release(NULL, &fi);
+
+	if((res = rufs_ope.open("/file", &fi)))
+		die("open", res);
+	bench_begin();
+	for(int i = 0; i < nblocks; i++)
+		if((res = rufs_ope.read(NULL, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE, &fi)) != BLOCK_SIZE)
+			die("rufs_read", res);
+	bench_end("rufs_read_seq", nblocks);
+	srand(seed);
+	bench_begin();
+	for(int i = 0; i < iters; i++)
+		if((res = rufs_ope.read(NULL, buf, BLOCK_SIZE, (off_t)(rand() % nblocks) * BLOCK_SIZE, &fi)) != BLOCK_SIZE)
+			die("rufs_read", res);
+	bench_end("rufs_read_rand", iters);
+	srand(seed + 1);
+	bench_begin();
+	for(int i = 0; i < iters; i++)
+		if((res = rufs_ope.write(NULL, buf, BLOCK_SIZE, (off_t)(rand() % nblocks) * BLOCK_SIZE, &fi)) != BLOCK_SIZE)
+			die("rufs_write", res);
+	bench_end("rufs_write_rand", iters);
+	rufs_ope.release(NULL, &fi);
+}
+
+int main(int argc, char *argv[]) {
+	const char *disk = NULL;
+	int c;
+
+	while((c = getopt(argc, argv, "n:e:D:s:r:d:")) != -1) {
+		switch(c) {
+		case 'n': iters = atoi(optarg); break;
+		case 'e': n_entries = atoi(optarg); break;
+		case 'D': depth = atoi(optarg); break;
+		case 's': file_mb = atoi(optarg); break;
+		case 'r': seed = strtoul(optarg, NULL, 0); break;
+		case 'd': disk = optarg; break;
+		default:
+			fprintf(stderr, "usage: microbench [-n iters] [-e entries] [-D depth] [-s file_mb] [-r seed] [-d diskfile]\n");
+			return 2;
+		}
+	}
+	if(iters <= 0 || n_entries <= 0 || depth <= 0 || file_mb <= 0)
+		return 2;
+
+	// Step 1: A fresh file system every run, with no background work to perturb the numbers
+	if(disk)
+		snprintf(diskfile_path, PATH_MAX, "%s", disk);
+	else
+		snprintf(diskfile_path, PATH_MAX, "/tmp/rufs_microbench.%d", (int)getpid());
+	unlink(diskfile_path);
+	rufs_opts.commit = 0;
+	rufs_opts.readahead = 0;
+	if((off_t)file_mb * 2 * 1024 * 1024 > rufs_opts.size)
+		rufs_opts.size = (off_t)file_mb * 2 * 1024 * 1024;
+	if(n_entries + depth + 16 > rufs_opts.size / rufs_opts.inode_ratio)
+		rufs_opts.inode_ratio = rufs_opts.size / (2 * (n_entries + depth + 16));
+	rufs_ope.init(NULL);
+
+	// Step 2: Run the benchmarks, then tear down and remove the disk
+	bench_alloc();
+	bench_dir();
+	bench_path();
+	bench_rw();
+	rufs_ope.destroy(NULL);
+	unlink(diskfile_path);
+	return 0;
+}
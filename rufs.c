@@ -18,138 +18,1720 @@
 #include <sys/time.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "block.h"
+#include "journal.h"
+#include "stats.h"
+#include "hash.h"
 #include "rufs.h"
 
 char diskfile_path[PATH_MAX];
 // Declare your in-memory data structures here
 struct superblock sb; // stores superblock metadata read during init
-bitmap_t bmp; // bitmap of size BLOCK_SIZE used with bio_read/write operations
-bitmap_t ibmp; // bitmap of size BLOCK_SIZE used with inode read/write operations
-int last_inode_blk = -1;
+struct group {
+	struct group_desc gd;	// free counts are kept current (atomic), written back by bitmaps_flush()
+	bitmap_t bmap;			// resident block bitmap, bit i is block group_start + i
+	bitmap_t imap;			// resident inode bitmap
+	int bmap_dirty, imap_dirty; // changed since bitmaps_flush()
+	pthread_mutex_t lock;	// everything above
+} *groups;
+unsigned char *bmap_mem; // bitmaps of all groups
+int gdt_dirty = 0; // group descriptors changed since bitmaps_flush() (atomic)
+int bitmaps_dirty = 0; // group bitmaps changed since bitmaps_flush() (atomic)
+int blkno_hint = 0; // allocations without a goal continue here (atomic)
+pthread_rwlock_t journal_lock; // shared by operations that change metadata, exclusive for a commit
+int journal_on = 0; // metadata only reaches its place through journal_commit()
+pthread_rwlock_t namespace_lock = PTHREAD_RWLOCK_INITIALIZER; // held exclusively while the directory tree changes
+pthread_rwlock_t *inode_locks; // one reader/writer lock per inode
+pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER; // inode cache and inode table blocks
+pthread_mutex_t ptr_cache_lock = PTHREAD_MUTEX_INITIALIZER; // pointer block cache
+time_t *lazy_atime; // access times not yet written to the inode table, 0 if none (atomic)
+
+/*
+ * Mount options: -o noatime|relatime|strictatime, -o commit=<seconds>,
+ * -o readahead=<blocks>, -o sync_readahead, -o backend=pread|mmap|uring and -o direct
+ * mkfs options, used when DISKFILE does not exist yet or with -o mkfs: -o size=<bytes>[K|M|G],
+ * -o blocksize=<bytes>, -o inode_ratio=<bytes per inode>, -o group_blocks=<blocks>
+ * and -o journal=<blocks> (0 for none)
+ */
+enum { ATIME_RELATIME, ATIME_NOATIME, ATIME_STRICT };
+struct rufs_options {
+	int atime;			// when reads update the access time
+	int commit;			// seconds between write-backs of dirty metadata, 0 for never
+	int readahead;		// largest readahead window in blocks, 0 for none
+	int sync_readahead;	// prefetch in the reading thread instead of the readahead thread
+	off_t size;			// mkfs: bytes on the disk
+	int block_size;		// mkfs: bytes per block
+	int inode_ratio;	// mkfs: bytes of disk per inode
+	int group_blocks;	// mkfs: blocks per block group, 0 for the most one bitmap block covers
+	int journal_blocks;	// mkfs: blocks in the journal, -1 for the default and 0 for none
+	int mkfs;			// format DISKFILE even if it exists
+} rufs_opts = { ATIME_RELATIME, 5, 256, 0, RUFS_DEFAULT_SIZE, BLOCK_SIZE, RUFS_DEFAULT_INODE_RATIO, 0, -1, 0 };
+/*
+ * Bitmap scans work 64 bits at a time: bit i of the bitmap is bit i%64 of word i/64 (little endian)
+ */
+// Returns the first clear bit in b[from, nbits), or nbits if there is none
+static int bitmap_next_clear(bitmap_t b, int nbits, int from) {
+	const uint64_t *words = (const uint64_t *)b;
+	if (from >= nbits)
+		return nbits;
+	int w = from / 64;
+	uint64_t bits = ~words[w] & (~0ULL << (from % 64)); // ignore bits below from
+	while (!bits) {
+		if (++w * 64 >= nbits)
+			return nbits;
+		bits = ~words[w];
+	}
+	int i = w * 64 + __builtin_ctzll(bits);
+	return i < nbits ? i : nbits;
+}
+
+// Returns the first set bit in b[from, nbits), or nbits if there is none
+static int bitmap_next_set(bitmap_t b, int nbits, int from) {
+	const uint64_t *words = (const uint64_t *)b;
+	if (from >= nbits)
+		return nbits;
+	int w = from / 64;
+	uint64_t bits = words[w] & (~0ULL << (from % 64));
+	while (!bits) {
+		if (++w * 64 >= nbits)
+			return nbits;
+		bits = words[w];
+	}
+	int i = w * 64 + __builtin_ctzll(bits);
+	return i < nbits ? i : nbits;
+}
+
+// Returns the first clear bit at or after hint, wrapping around, or -1 if every bit is set
+static int bitmap_find_free(bitmap_t b, int nbits, int hint) {
+	if (hint < 0 || hint >= nbits)
+		hint = 0;
+	int i = bitmap_next_clear(b, nbits, hint);
+	if (i == nbits)
+		i = bitmap_next_clear(b, hint, 0);
+	return i < nbits && !get_bitmap(b, i) ? i : -1;
+}
+
+/*
+ * Block groups
+ * Group g covers blocks [g * blocks_per_group, (g + 1) * blocks_per_group) and inodes
+ * [g * inodes_per_group, (g + 1) * inodes_per_group). Each group keeps its own block bitmap,
+ * inode bitmap and inode table at its start (after the superblock and descriptors in group 0),
+ * both bitmaps stay resident and every group has its own lock.
+ */
+static int group_start(int g) {
+	return g * sb.blocks_per_group;
+}
+
+// Blocks in group g, the last group can be short
+static int group_blocks(int g) {
+	int n = sb.max_dnum - group_start(g);
+	return n < (int)sb.blocks_per_group ? n : (int)sb.blocks_per_group;
+}
+
+static int block_group(int blkno) {
+	return blkno / sb.blocks_per_group;
+}
+
+static int inode_group(int ino) {
+	return ino / sb.inodes_per_group;
+}
+
+// First block of group g after its metadata
+static int group_first_data(int g) {
+	return groups[g].gd.inode_table + sb.inodes_per_group * sizeof(struct inode) / BLOCK_SIZE;
+}
+
+// Allocation goal for the blocks of inode ino when nothing better is known
+static int group_goal(int ino) {
+	return group_first_data(inode_group(ino));
+}
+
+static int gdt_blocks() {
+	return (sb.groups * sizeof(struct group_desc) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/*
+ * Allocate the resident group state for the geometry in sb, all bitmaps clear
+ */
+static int groups_alloc() {
+	groups = calloc(sb.groups,sizeof(struct group));
+	bmap_mem = calloc((size_t)sb.groups * 2,BLOCK_SIZE);
+	if(!groups || !bmap_mem)
+		return -ENOMEM;
+	for(int g = 0; g < sb.groups; g++) {
+		groups[g].bmap = bmap_mem + (size_t)g * 2 * BLOCK_SIZE;
+		groups[g].imap = groups[g].bmap + BLOCK_SIZE;
+		pthread_mutex_init(&groups[g].lock,NULL);
+	}
+	return 0;
+}
+
+static void groups_free() {
+	for(int g = 0; groups && g < sb.groups; g++)
+		pthread_mutex_destroy(&groups[g].lock);
+	free(groups);
+	free(bmap_mem);
+	groups = NULL;
+	bmap_mem = NULL;
+	bitmaps_dirty = 0;
+}
+
+// Mark the bitmap behind flag (gr->bmap_dirty or gr->imap_dirty) changed, the group lock held
+static void group_mark_dirty(int *flag) {
+	if(!*flag)
+		__atomic_add_fetch(&bitmaps_dirty,1,__ATOMIC_RELAXED);
+	*flag = 1;
+}
+
+/*
+ * Write the changed group bitmaps and the group descriptors back to their blocks
+ */
+int bitmaps_flush() {
+	int res = 0;
+	int gdt = __atomic_exchange_n(&gdt_dirty,0,__ATOMIC_RELAXED);
+	const int ngdt = gdt_blocks();
+	struct group_desc *gdt_buf = gdt ? calloc(ngdt,BLOCK_SIZE) : NULL;
+	if(gdt && !gdt_buf) {
+		__atomic_store_n(&gdt_dirty,1,__ATOMIC_RELAXED);
+		return -ENOMEM;
+	}
+	for(int g = 0; g < sb.groups; g++) {
+		struct group *gr = &groups[g];
+		pthread_mutex_lock(&gr->lock);
+		if(gr->bmap_dirty) {
+			if(bio_write(gr->gd.block_bitmap,gr->bmap) <= 0)
+				res = -EIO;
+			else {
+				gr->bmap_dirty = 0;
+				__atomic_sub_fetch(&bitmaps_dirty,1,__ATOMIC_RELAXED);
+			}
+		}
+		if(gr->imap_dirty) {
+			if(bio_write(gr->gd.inode_bitmap,gr->imap) <= 0)
+				res = -EIO;
+			else {
+				gr->imap_dirty = 0;
+				__atomic_sub_fetch(&bitmaps_dirty,1,__ATOMIC_RELAXED);
+			}
+		}
+		if(gdt_buf)
+			gdt_buf[g] = gr->gd;
+		pthread_mutex_unlock(&gr->lock);
+	}
+	if(gdt_buf) { // through the block cache, so the journal commits it with the bitmaps
+		for(int i = 0; i < ngdt; i++)
+			if(bio_write(sb.gdt_blk + i,(unsigned char *)gdt_buf + (size_t)i * BLOCK_SIZE) <= 0) {
+				__atomic_store_n(&gdt_dirty,1,__ATOMIC_RELAXED);
+				res = -EIO;
+			}
+		free(gdt_buf);
+	}
+	return res;
+}
+
+// Group for a new directory: one with at least the average number of free inodes
+// and the most free blocks, so directories and what they hold spread over the disk
+static int find_group_dir() {
+	long free_inodes = 0;
+	for(int g = 0; g < sb.groups; g++)
+		free_inodes += __atomic_load_n(&groups[g].gd.free_inodes,__ATOMIC_RELAXED);
+	long avg = free_inodes / sb.groups;
+	int best = -1;
+	uint32_t best_blocks = 0;
+	for(int g = 0; g < sb.groups; g++) {
+		uint32_t fi = __atomic_load_n(&groups[g].gd.free_inodes,__ATOMIC_RELAXED);
+		uint32_t fb = __atomic_load_n(&groups[g].gd.free_blocks,__ATOMIC_RELAXED);
+		if(fi && fi >= avg && (best == -1 || fb > best_blocks)) {
+			best = g;
+			best_blocks = fb;
+		}
+	}
+	return best == -1 ? 0 : best;
+}
+
 /* 
- * Get available inode number from bitmap
+ * Get available inode number from the group bitmaps
+ * Directories go to a lightly used group, files to the group of their parent directory
  * Returns -1 if none found
  */
-int get_avail_ino() {
-	// Step 1: Read inode bitmap from disk
-	if(bio_read(sb.i_bitmap_blk,bmp) <= 0)
-		return -2;
-	int ino = -1; // stores next availaible inode number, if none exist it is 0
-	// Step 2: Traverse inode bitmap to find an available slot
-	for(int i = 0; i < sb.max_inum; i++)
-		if(!get_bitmap(bmp,i)) {
-			ino = i;
-			break;
+int get_avail_ino(int parent, int is_dir) {
+	// Step 1: Pick the group to start from
+	int g0 = is_dir ? find_group_dir() : (parent >= 0 ? inode_group(parent) : 0);
+	// Step 2: Traverse its resident inode bitmap, then the following groups
+	for(int k = 0; k < sb.groups; k++) {
+		int g = (g0 + k) % sb.groups;
+		struct group *gr = &groups[g];
+		if(!__atomic_load_n(&gr->gd.free_inodes,__ATOMIC_RELAXED))
+			continue;
+		pthread_mutex_lock(&gr->lock);
+		stats_count(SC_ALLOC_SCANS,1);
+		int i = bitmap_find_free(gr->imap,sb.inodes_per_group,0);
+		// Step 3: Update the group, it is written back by bitmaps_flush()
+		if(i != -1) {
+			set_bitmap(gr->imap,i);
+			group_mark_dirty(&gr->imap_dirty);
+			__atomic_sub_fetch(&gr->gd.free_inodes,1,__ATOMIC_RELAXED);
+			gr->gd.used_dirs += is_dir;
+			__atomic_store_n(&gdt_dirty,1,__ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&gr->lock);
+		if(i != -1) {
+			stats_count(SC_ALLOC_INODES,1);
+			return g * sb.inodes_per_group + i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Return an inode number to its group
+ */
+void release_ino(int ino, int is_dir) {
+	struct group *gr = &groups[inode_group(ino)];
+	pthread_mutex_lock(&gr->lock);
+	unset_bitmap(gr->imap,ino % sb.inodes_per_group);
+	group_mark_dirty(&gr->imap_dirty);
+	__atomic_add_fetch(&gr->gd.free_inodes,1,__ATOMIC_RELAXED);
+	gr->gd.used_dirs -= is_dir;
+	__atomic_store_n(&gdt_dirty,1,__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&gr->lock);
+}
+
+/*
+ * Return a data block to its group
+ */
+void release_blkno(int blkno) {
+	struct group *gr = &groups[block_group(blkno)];
+	pthread_mutex_lock(&gr->lock);
+	unset_bitmap(gr->bmap,blkno - group_start(block_group(blkno)));
+	group_mark_dirty(&gr->bmap_dirty);
+	__atomic_add_fetch(&gr->gd.free_blocks,1,__ATOMIC_RELAXED);
+	__atomic_store_n(&gdt_dirty,1,__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&gr->lock);
+}
+
+// Returns the start of a run of count clear bits in b[0, nbits), looking after hint first
+// and then before it, or -1 if there is none
+static int bitmap_find_run(bitmap_t b, int nbits, int hint, int count) {
+	for(int pass = 0; pass < 2; pass++) {
+		int pos = pass == 0 ? hint : 0;
+		const int limit = pass == 0 ? nbits : hint;
+		while((pos = bitmap_next_clear(b,nbits,pos)) < limit) {
+			int end = bitmap_next_set(b,nbits,pos);
+			if(end - pos >= count)
+				return pos;
+			pos = end;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Get count available data blocks, as close after goal as possible
+ * A single contiguous run is preferred, first in the group of goal and then in the groups
+ * after it, otherwise the first free blocks from goal on are used
+ * goal < 0 continues after the last allocation
+ * Block numbers are stored in blknos in ascending order of allocation
+ * Returns count, or -1 if there are not enough free blocks (nothing is allocated then)
+ */
+int get_avail_blknos(int count, int *blknos, int goal) {
+	if(count <= 0)
+		return 0;
+	if(goal < 0 || goal >= sb.max_dnum)
+		goal = __atomic_load_n(&blkno_hint,__ATOMIC_RELAXED) % sb.max_dnum;
+	const int g0 = block_group(goal);
+	// Step 1: Look for a free run of count blocks, from the goal on
+	for(int k = 0; k < sb.groups; k++) {
+		int g = (g0 + k) % sb.groups;
+		struct group *gr = &groups[g];
+		if(__atomic_load_n(&gr->gd.free_blocks,__ATOMIC_RELAXED) < count)
+			continue;
+		pthread_mutex_lock(&gr->lock);
+		stats_count(SC_ALLOC_SCANS,1);
+		int start = bitmap_find_run(gr->bmap,group_blocks(g),k == 0 ? goal - group_start(g) : 0,count);
+		if(start != -1) {
+			// Step 2: Update the group, it is written back by bitmaps_flush()
+			for(int i = 0; i < count; i++) {
+				set_bitmap(gr->bmap,start + i);
+				blknos[i] = group_start(g) + start + i;
+			}
+			group_mark_dirty(&gr->bmap_dirty);
+			__atomic_sub_fetch(&gr->gd.free_blocks,count,__ATOMIC_RELAXED);
+			__atomic_store_n(&gdt_dirty,1,__ATOMIC_RELAXED);
+			pthread_mutex_unlock(&gr->lock);
+			__atomic_store_n(&blkno_hint,blknos[count - 1] + 1,__ATOMIC_RELAXED);
+			stats_count(SC_ALLOC_BLOCKS,count);
+			return count;
+		}
+		pthread_mutex_unlock(&gr->lock);
+	}
+	// Step 3: No run is long enough, gather free blocks in order group by group
+	int n = 0;
+	for(int k = 0; k < sb.groups && n < count; k++) {
+		int g = (g0 + k) % sb.groups;
+		struct group *gr = &groups[g];
+		pthread_mutex_lock(&gr->lock);
+		stats_count(SC_ALLOC_SCANS,1);
+		const int nbits = group_blocks(g);
+		int pos = k == 0 ? goal - group_start(g) : 0;
+		for(int pass = 0; pass < 2 && n < count; pass++) {
+			const int limit = pass == 0 ? nbits : goal - group_start(g);
+			if(pass == 1) {
+				if(k != 0)
+					break;
+				pos = 0;
+			}
+			while(n < count && (pos = bitmap_next_clear(gr->bmap,limit,pos)) < limit) {
+				set_bitmap(gr->bmap,pos);
+				group_mark_dirty(&gr->bmap_dirty);
+				__atomic_sub_fetch(&gr->gd.free_blocks,1,__ATOMIC_RELAXED);
+				blknos[n++] = group_start(g) + pos++;
+			}
+		}
+		pthread_mutex_unlock(&gr->lock);
+	}
+	__atomic_store_n(&gdt_dirty,1,__ATOMIC_RELAXED);
+	if(n < count) {
+		while(n > 0)
+			release_blkno(blknos[--n]);
+		return -1;
+	}
+	__atomic_store_n(&blkno_hint,blknos[count - 1] + 1,__ATOMIC_RELAXED);
+	stats_count(SC_ALLOC_BLOCKS,count);
+	return count;
+}
+
+/* 
+ * Get an available data block number, as close after goal as possible (-1 for no goal)
+ * Returns -1 if none found
+ */
+int get_avail_blkno(int goal) {
+	int blkno;
+	return get_avail_blknos(1,&blkno,goal) == 1 ? blkno : -1;
+}
+
+/* 
+ * inode operations
+ */
+/*
+ * Inode cache
+ * Inodes are kept by number in a hash table. readi and writei only copy to and from the
+ * cache, dirty inodes go back to the inode table when they are evicted or flushed and all
+ * dirty inodes of one inode table block are written with a single bio_write.
+ * Entries with references (iget) are never evicted.
+ */
+#define ICACHE_SIZE 512
+#define ICACHE_BUCKETS 1024
+
+struct icache_entry {
+	struct inode inode;
+	int ino;						// -1 if the entry is unused
+	int ref;						// iget references
+	int dirty;						// inode differs from the inode table
+	int referenced;					// CLOCK bit
+	struct icache_entry *next;		// hash chain
+};
+
+static struct icache_entry icache[ICACHE_SIZE];
+static struct icache_entry *icache_hash[ICACHE_BUCKETS];
+static int icache_hand = 0;
+static int icache_dirty = 0; // dirty entries (atomic)
+
+static unsigned int itable_blkno(int ino) {
+	return ((ino % sb.inodes_per_group) * sizeof(struct inode)) / BLOCK_SIZE + groups[inode_group(ino)].gd.inode_table;
+}
+
+static void icache_set_dirty(struct icache_entry *e, int dirty) {
+	if(e->dirty != dirty)
+		__atomic_add_fetch(&icache_dirty,dirty ? 1 : -1,__ATOMIC_RELAXED);
+	e->dirty = dirty;
+}
+
+void icache_init() {
+	memset(icache_hash,0,sizeof(icache_hash));
+	for(int i = 0; i < ICACHE_SIZE; i++) {
+		icache[i].ino = -1;
+		icache[i].ref = icache[i].dirty = icache[i].referenced = 0;
+		icache[i].next = NULL;
+	}
+	icache_hand = 0;
+	icache_dirty = 0;
+}
+
+static struct icache_entry *icache_lookup(int ino) {
+	struct icache_entry *e = icache_hash[ino % ICACHE_BUCKETS];
+	while(e && e->ino != ino)
+		e = e->next;
+	return e;
+}
+
+static void icache_unhash(struct icache_entry *e) {
+	struct icache_entry **p = &icache_hash[e->ino % ICACHE_BUCKETS];
+	while(*p != e)
+		p = &(*p)->next;
+	*p = e->next;
+	e->ino = -1;
+}
+
+// Write every dirty inode that lives in inode table block blkno, icache_lock held
+static int icache_write_block(unsigned int blkno) {
+	unsigned char block[BLOCK_SIZE];
+	if(bio_read(blkno,block) <= 0)
+		return -EIO;
+	for(int i = 0; i < ICACHE_SIZE; i++) {
+		struct icache_entry *e = &icache[i];
+		if(e->ino >= 0 && e->dirty && itable_blkno(e->ino) == blkno)
+			memcpy(block + (e->ino * sizeof(struct inode)) % BLOCK_SIZE,&e->inode,sizeof(struct inode));
+	}
+	if(bio_write(blkno,block) <= 0)
+		return -EIO;
+	for(int i = 0; i < ICACHE_SIZE; i++)
+		if(icache[i].ino >= 0 && itable_blkno(icache[i].ino) == blkno)
+			icache_set_dirty(&icache[i],0);
+	return 0;
+}
+
+// Returns the cache entry of ino, reading it from the inode table on a miss, icache_lock held
+// Returns NULL if every entry is referenced or the inode cannot be read
+static struct icache_entry *icache_get(int ino) {
+	struct icache_entry *e = icache_lookup(ino);
+	if(e) {
+		e->referenced = 1;
+		return e;
+	}
+	// Step 1: Find a victim with CLOCK, unreferenced entries only
+	for(int scanned = 0; scanned < 2 * ICACHE_SIZE && !e; scanned++) {
+		struct icache_entry *c = &icache[icache_hand];
+		icache_hand = (icache_hand + 1) % ICACHE_SIZE;
+		if(c->ref)
+			continue;
+		if(c->ino >= 0 && c->referenced) {
+			c->referenced = 0;
+			continue;
+		}
+		if(c->ino >= 0 && c->dirty && icache_write_block(itable_blkno(c->ino)))
+			continue;
+		e = c;
+	}
+	if(!e)
+		return NULL;
+	if(e->ino >= 0)
+		icache_unhash(e);
+	// Step 2: Read the inode from the inode table
+	unsigned char block[BLOCK_SIZE];
+	if(bio_read(itable_blkno(ino),block) <= 0)
+		return NULL;
+	memcpy(&e->inode,block + (ino * sizeof(struct inode)) % BLOCK_SIZE,sizeof(struct inode));
+	e->ino = ino;
+	icache_set_dirty(e,0);
+	e->referenced = 1;
+	e->next = icache_hash[ino % ICACHE_BUCKETS];
+	icache_hash[ino % ICACHE_BUCKETS] = e;
+	return e;
+}
+
+// Write all dirty inodes back to the inode table
+int icache_flush() {
+	int res = 0;
+	pthread_mutex_lock(&icache_lock);
+	for(int i = 0; i < ICACHE_SIZE; i++)
+		if(icache[i].ino >= 0 && icache[i].dirty && icache_write_block(itable_blkno(icache[i].ino)))
+			res = -EIO;
+	pthread_mutex_unlock(&icache_lock);
+	return res;
+}
+
+// Keep ino in the cache until iput, returns the cached inode or NULL
+struct inode *iget(uint16_t ino) {
+	if(ino >= sb.max_inum)
+		return NULL;
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e = icache_get(ino);
+	if(e)
+		e->ref++;
+	pthread_mutex_unlock(&icache_lock);
+	return e ? &e->inode : NULL;
+}
+
+void iput(struct inode *inode) {
+	struct icache_entry *e = (struct icache_entry *)inode; // inode is the first member
+	pthread_mutex_lock(&icache_lock);
+	e->ref--;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+int readi(uint16_t ino, struct inode *inode) {
+	// printf("readi called on ino %d\n",ino);
+	if(ino >= sb.max_inum)
+		return 1;
+	// Step 1: Look the inode up in the inode cache, which reads its inode table block on a miss
+	unsigned char block[BLOCK_SIZE];
+	int res = 0;
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e = icache_get(ino);
+	if(e)
+		memcpy(inode,&e->inode,sizeof(struct inode));
+	else if(bio_read(itable_blkno(ino),block) > 0) // cache full of referenced inodes, read around it
+		memcpy(inode,block + (ino * sizeof(struct inode)) % BLOCK_SIZE,sizeof(struct inode));
+	else
+		res = -EIO;
+	pthread_mutex_unlock(&icache_lock);
+	if(res)
+		return res;
+	// Step 2: A pending access time is newer than the one in the inode table
+	time_t atime = lazy_atime ? __atomic_load_n(&lazy_atime[ino],__ATOMIC_RELAXED) : 0;
+	if(atime > inode->vstat.st_atime)
+		inode->vstat.st_atime = atime;
+	// printf("readi called on ino %d done\n",ino);
+	return 0;
+}
+int writei(uint16_t ino, struct inode *inode) {
+	// printf("writei called on ino %d\n",ino);
+	if(ino >= sb.max_inum)
+		return 1;
+	// Step 1: Update the cached inode, it reaches the inode table when it is evicted or flushed
+	unsigned char block[BLOCK_SIZE];
+	int res = 0;
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e = icache_get(ino);
+	if(e) {
+		memcpy(&e->inode,inode,sizeof(struct inode));
+		icache_set_dirty(e,1);
+	} else if(bio_read(itable_blkno(ino),block) > 0) { // cache full of referenced inodes, write through
+		memcpy(block + (ino * sizeof(struct inode)) % BLOCK_SIZE,inode,sizeof(struct inode));
+		if(bio_write(itable_blkno(ino),block) <= 0)
+			res = -EIO;
+	} else
+		res = -EIO;
+	pthread_mutex_unlock(&icache_lock);
+	// printf("writei called on ino %d done\n",ino);
+	return res;
+}
+
+/*
+ * block mapping
+ */
+// Set up an empty block map for a new inode, using extents if the file system has them
+void inode_init_map(struct inode *inode) {
+	memset(inode->direct_ptr,0,sizeof(inode->direct_ptr) + sizeof(inode->indirect_ptr));
+	if(sb.features & RUFS_FEATURE_EXTENTS) {
+		inode->type |= RUFS_EXTENTS_FL;
+		inode->eh.magic = EXTENT_MAGIC;
+		inode->eh.max = EXTENTS_PER_INODE;
+	}
+}
+
+// Returns the index of the last entry with lblk <= target, or -1 if target is before all of them
+static int ext_search(const struct extent *ext, int n, uint32_t lblk) {
+	int lo = 0, hi = n - 1, found = -1;
+	while(lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if(ext[mid].lblk <= lblk) {
+			found = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	return found;
+}
+
+// Map lblk through a sorted extent array, returns 0 for a hole
+static int ext_map(const struct extent *ext, int n, uint32_t lblk, uint32_t *run) {
+	int i = ext_search(ext,n,lblk);
+	*run = 1;
+	if(i < 0 || lblk >= ext[i].lblk + ext[i].len)
+		return 0;
+	*run = ext[i].len - (lblk - ext[i].lblk);
+	return ext[i].pblk + (lblk - ext[i].lblk);
+}
+
+// Add a mapping to a sorted extent array, merging with its neighbours when they are contiguous
+// Returns -ENOSPC if a new entry is needed and the array is full
+static int ext_array_insert(struct extent *ext, uint16_t *n, int max, uint32_t lblk, uint32_t pblk, uint32_t len) {
+	int i = ext_search(ext,*n,lblk);
+	int merged = 0;
+	if(i >= 0 && ext[i].lblk + ext[i].len == lblk && ext[i].pblk + ext[i].len == pblk) {
+		ext[i].len += len;
+		merged = 1;
+	}
+	if(i + 1 < *n && lblk + len == ext[i + 1].lblk && pblk + len == ext[i + 1].pblk) {
+		if(merged) { // the new range joins two extents
+			ext[i].len += ext[i + 1].len;
+			memmove(&ext[i + 1],&ext[i + 2],(*n - i - 2) * sizeof(struct extent));
+			(*n)--;
+		} else {
+			ext[i + 1].lblk = lblk;
+			ext[i + 1].pblk = pblk;
+			ext[i + 1].len += len;
+		}
+		merged = 1;
+	}
+	if(merged)
+		return 0;
+	if(*n >= max)
+		return -ENOSPC;
+	memmove(&ext[i + 2],&ext[i + 1],(*n - i - 1) * sizeof(struct extent));
+	ext[i + 1].lblk = lblk;
+	ext[i + 1].pblk = pblk;
+	ext[i + 1].len = len;
+	(*n)++;
+	return 0;
+}
+
+// Map lblk through the extent tree, descending from the root through depth index levels
+static int ext_lookup(struct inode *inode, uint32_t lblk, uint32_t *run) {
+	unsigned char node[BLOCK_SIZE];
+	struct extent_header *eh = &inode->eh;
+	*run = 1;
+	while(eh->depth > 0) {
+		const struct extent *ext = (const struct extent *)(eh + 1);
+		int i = ext_search(ext,eh->entries,lblk);
+		if(i < 0)
+			return 0;
+		const int depth = eh->depth;
+		if(bio_read(ext[i].pblk,node) <= 0)
+			return -EIO;
+		eh = (struct extent_header *)node;
+		if(eh->magic != EXTENT_MAGIC || eh->depth != depth - 1 || eh->entries > EXTENTS_PER_BLOCK)
+			return -EIO;
+	}
+	return ext_map((const struct extent *)(eh + 1),eh->entries,lblk,run);
+}
+
+static void ext_node_init(unsigned char *block, int depth) {
+	memset(block,0,BLOCK_SIZE);
+	struct extent_header *h = (struct extent_header *)block;
+	h->magic = EXTENT_MAGIC;
+	h->max = EXTENTS_PER_BLOCK;
+	h->depth = depth;
+}
+
+/*
+ * Full root: move its entries to a new block one level down and leave the root with a
+ * single entry pointing at it, then add (lblk, pblk, len) to the new block
+ */
+static int ext_grow_root(struct inode *inode, uint32_t lblk, uint32_t pblk, uint32_t len) {
+	if(inode->eh.depth >= EXTENT_MAX_DEPTH)
+		return -EFBIG;
+	int blk = get_avail_blkno(group_goal(inode->ino));
+	if(blk < 0)
+		return -ENOSPC;
+	unsigned char block[BLOCK_SIZE];
+	ext_node_init(block,inode->eh.depth);
+	struct extent_header *h = (struct extent_header *)block;
+	h->entries = inode->eh.entries;
+	memcpy(h + 1,inode->ext,inode->eh.entries * sizeof(struct extent));
+	ext_array_insert((struct extent *)(h + 1),&h->entries,h->max,lblk,pblk,len);
+	if(bio_write(blk,block) <= 0) {
+		release_blkno(blk);
+		return -EIO;
+	}
+	memset(inode->ext,0,sizeof(inode->ext));
+	inode->ext[0].pblk = blk; // the first child always starts at logical block 0
+	inode->eh.entries = 1;
+	inode->eh.depth++;
+	return 0;
+}
+
+/*
+ * Add (lblk, pblk, len) to the subtree under node eh, which is the inode's root or a block
+ * the caller writes back. Index entries have len 0.
+ * A full block is split: appends start a fresh block, anything else moves the upper half.
+ * The new block's first lblk and number are returned in split, which the caller adds to
+ * the level above (split->pblk is 0 if nothing was split)
+ */
+static int ext_node_insert(struct inode *inode, struct extent_header *eh, uint32_t lblk, uint32_t pblk, uint32_t len, struct extent *split) {
+	struct extent *ext = (struct extent *)(eh + 1);
+	split->pblk = 0;
+	// Step 1: Below the leaves, insert into the child covering lblk first
+	if(eh->depth > 0) {
+		unsigned char child[BLOCK_SIZE];
+		int i = ext_search(ext,eh->entries,lblk);
+		if(i < 0)
+			i = 0;
+		if(bio_read(ext[i].pblk,child) <= 0)
+			return -EIO;
+		struct extent_header *ch = (struct extent_header *)child;
+		if(ch->magic != EXTENT_MAGIC || ch->depth != eh->depth - 1 || ch->entries > EXTENTS_PER_BLOCK)
+			return -EIO;
+		struct extent child_split;
+		int res = ext_node_insert(inode,ch,lblk,pblk,len,&child_split);
+		if(res)
+			return res;
+		if(bio_write(ext[i].pblk,child) <= 0)
+			return -EIO;
+		if(!child_split.pblk)
+			return 0;
+		lblk = child_split.lblk;
+		pblk = child_split.pblk;
+		len = 0;
+	}
+	// Step 2: Add the entry to this node
+	if(ext_array_insert(ext,&eh->entries,eh->max,lblk,pblk,len) == 0)
+		return 0;
+	if(eh == &inode->eh)
+		return ext_grow_root(inode,lblk,pblk,len);
+	// Step 3: The block is full, split it
+	int new_blk = get_avail_blkno(group_goal(inode->ino));
+	if(new_blk < 0)
+		return -ENOSPC;
+	unsigned char new_node[BLOCK_SIZE];
+	ext_node_init(new_node,eh->depth);
+	struct extent_header *nh = (struct extent_header *)new_node;
+	struct extent *ne = (struct extent *)(nh + 1);
+	uint32_t split_lblk = lblk;
+	if(lblk < ext[eh->entries - 1].lblk) {
+		int keep = eh->entries / 2;
+		nh->entries = eh->entries - keep;
+		memcpy(ne,ext + keep,nh->entries * sizeof(struct extent));
+		eh->entries = keep;
+		split_lblk = ne[0].lblk;
+	}
+	if(lblk < split_lblk)
+		ext_array_insert(ext,&eh->entries,eh->max,lblk,pblk,len);
+	else
+		ext_array_insert(ne,&nh->entries,nh->max,lblk,pblk,len);
+	if(bio_write(new_blk,new_node) <= 0) {
+		release_blkno(new_blk);
+		return -EIO;
+	}
+	split->lblk = split_lblk;
+	split->pblk = new_blk;
+	split->len = 0;
+	return 0;
+}
+
+static int ext_insert(struct inode *inode, uint32_t lblk, uint32_t pblk, uint32_t len) {
+	struct extent split;
+	return ext_node_insert(inode,&inode->eh,lblk,pblk,len,&split);
+}
+
+/*
+ * Pointer blocks of indirect maps are kept in a small direct-mapped cache
+ * so sequential access does not re-read them for every block
+ */
+#define PTR_CACHE_SLOTS 8
+
+struct ptr_block {
+	int blkno;					// 0 if the slot is empty
+	int dirty;					// changed since it was last written
+	int ptrs[PTRS_PER_BLOCK];
+};
+struct ptr_block ptr_cache[PTR_CACHE_SLOTS];
+
+static int ptr_block_writeback(struct ptr_block *pb) {
+	if(pb->blkno && pb->dirty) {
+		if(bio_write(pb->blkno,pb->ptrs) <= 0)
+			return -EIO;
+		pb->dirty = 0;
+	}
+	return 0;
+}
+
+// Write back every pointer block changed by bmap_set()
+static int ptr_cache_flush() {
+	for(int i = 0; i < PTR_CACHE_SLOTS; i++)
+		if(ptr_block_writeback(&ptr_cache[i]))
+			return -EIO;
+	return 0;
+}
+
+static int *ptr_block_get(int blkno) {
+	struct ptr_block *pb = &ptr_cache[blkno % PTR_CACHE_SLOTS];
+	if(pb->blkno != blkno) {
+		if(ptr_block_writeback(pb))
+			return NULL;
+		pb->blkno = 0;
+		if(bio_read(blkno,pb->ptrs) <= 0)
+			return NULL;
+		pb->blkno = blkno;
+	}
+	return pb->ptrs;
+}
+
+static int ptr_block_set(int blkno, int idx, int value) {
+	int *ptrs = ptr_block_get(blkno);
+	if(!ptrs)
+		return -EIO;
+	ptrs[idx] = value;
+	ptr_cache[blkno % PTR_CACHE_SLOTS].dirty = 1;
+	return 0;
+}
+
+// Allocate a zeroed pointer block near goal, returns its block number or a negative error
+static int ptr_block_new(int goal) {
+	int blkno = get_avail_blkno(goal);
+	if(blkno < 0)
+		return -ENOSPC;
+	struct ptr_block *pb = &ptr_cache[blkno % PTR_CACHE_SLOTS];
+	if(ptr_block_writeback(pb))
+		return -EIO;
+	memset(pb->ptrs,0,sizeof(pb->ptrs));
+	pb->blkno = blkno;
+	pb->dirty = 1;
+	return blkno;
+}
+
+/*
+ * Find the pointer block and index holding the mapping of lblk (at least DIRECT_PTRS)
+ * Missing pointer blocks are allocated if create is set, otherwise *blkno is 0 for a hole
+ */
+static int ind_locate(struct inode *inode, uint32_t lblk, int create, int *blkno, int *idx) {
+	int *top;
+	lblk -= DIRECT_PTRS;
+	if(lblk < SINGLE_INDIRECT * PTRS_PER_BLOCK) {
+		top = &inode->indirect_ptr[lblk / PTRS_PER_BLOCK];
+		*idx = lblk % PTRS_PER_BLOCK;
+	} else {
+		lblk -= SINGLE_INDIRECT * PTRS_PER_BLOCK;
+		if(lblk >= PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+			return -EFBIG;
+		top = &inode->indirect_ptr[SINGLE_INDIRECT];
+		*idx = lblk % PTRS_PER_BLOCK;
+	}
+	if(*top == 0) {
+		*blkno = 0;
+		if(!create)
+			return 0;
+		if((*top = ptr_block_new(group_goal(inode->ino))) < 0) {
+			int err = *top;
+			*top = 0;
+			return err;
+		}
+	}
+	if(top != &inode->indirect_ptr[SINGLE_INDIRECT]) {
+		*blkno = *top;
+		return 0;
+	}
+	// double indirect, go through the middle pointer block
+	int *ptrs = ptr_block_get(*top);
+	if(!ptrs)
+		return -EIO;
+	*blkno = ptrs[lblk / PTRS_PER_BLOCK];
+	if(*blkno == 0 && create) {
+		*blkno = ptr_block_new(group_goal(inode->ino));
+		if(*blkno < 0)
+			return *blkno;
+		int res = ptr_block_set(*top,lblk / PTRS_PER_BLOCK,*blkno);
+		if(res) { // never linked in, drop it so its zeros are not written over the freed block
+			struct ptr_block *pb = &ptr_cache[*blkno % PTR_CACHE_SLOTS];
+			if(pb->blkno == *blkno)
+				pb->blkno = pb->dirty = 0;
+			release_blkno(*blkno);
 		}
-	// Step 3: Update inode bitmap and write to disk 
-	if(ino != -1) {
-		set_bitmap(bmp,ino);
-		if(bio_write(sb.i_bitmap_blk,bmp) <= 0)
-			return -2;
+		return res;
+	}
+	return 0;
+}
+
+/*
+ * Map logical block lblk of inode to its data block
+ * Returns the block number, 0 for a hole or a negative error
+ * *run is set to how many blocks from lblk on are physically contiguous (1 for a hole)
+ */
+int bmap(struct inode *inode, uint32_t lblk, uint32_t *run) {
+	if(inode->type & RUFS_EXTENTS_FL)
+		return ext_lookup(inode,lblk,run);
+	*run = 1;
+	if(lblk < DIRECT_PTRS) {
+		int pblk = inode->direct_ptr[lblk];
+		if(pblk)
+			while(lblk + *run < DIRECT_PTRS && inode->direct_ptr[lblk + *run] == pblk + *run)
+				(*run)++;
+		return pblk;
+	}
+	int blkno, idx, pblk = 0;
+	pthread_mutex_lock(&ptr_cache_lock);
+	int res = ind_locate(inode,lblk,0,&blkno,&idx);
+	if(res) {
+		pblk = res == -EFBIG ? 0 : res; // past the largest file is a hole
+	} else if(blkno) {
+		int *ptrs = ptr_block_get(blkno);
+		if(!ptrs)
+			pblk = -EIO;
+		else if((pblk = ptrs[idx]))
+			while(idx + *run < PTRS_PER_BLOCK && ptrs[idx + *run] == pblk + *run)
+				(*run)++;
+	}
+	pthread_mutex_unlock(&ptr_cache_lock);
+	return pblk;
+}
+
+/*
+ * Map count logical blocks starting at lblk to the data blocks starting at pblk
+ * The caller writes the inode back
+ */
+int bmap_set(struct inode *inode, uint32_t lblk, uint32_t pblk, uint32_t count) {
+	if(inode->type & RUFS_EXTENTS_FL)
+		return ext_insert(inode,lblk,pblk,count);
+	int res = 0;
+	uint32_t done = 0;
+	pthread_mutex_lock(&ptr_cache_lock);
+	for(; done < count && !res; done++) {
+		if(lblk + done < DIRECT_PTRS) {
+			inode->direct_ptr[lblk + done] = pblk + done;
+			continue;
+		}
+		int blkno, idx;
+		res = ind_locate(inode,lblk + done,1,&blkno,&idx);
+		if(!res)
+			res = ptr_block_set(blkno,idx,pblk + done);
+	}
+	// Undo the partial mapping so the caller can release the blocks. Pointer blocks allocated
+	// during this call stay linked in and are not reclaimed here, they are reused by later
+	// writes or released with the file
+	if(res)
+		for(uint32_t i = 0; i + 1 < done; i++) {
+			int blkno, idx;
+			if(lblk + i < DIRECT_PTRS)
+				inode->direct_ptr[lblk + i] = 0;
+			else if(ind_locate(inode,lblk + i,0,&blkno,&idx) == 0 && blkno)
+				ptr_block_set(blkno,idx,0);
+		}
+	if(ptr_cache_flush())
+		res = -EIO;
+	pthread_mutex_unlock(&ptr_cache_lock);
+	return res;
+}
+
+// Release the blocks under extent tree node eh and the tree blocks below it
+static int ext_node_free(const struct extent_header *eh) {
+	const struct extent *ext = (const struct extent *)(eh + 1);
+	unsigned char node[BLOCK_SIZE];
+	for(int i = 0; i < eh->entries; i++) {
+		if(eh->depth == 0) {
+			for(uint32_t k = 0; k < ext[i].len; k++)
+				release_blkno(ext[i].pblk + k);
+			continue;
+		}
+		if(bio_read(ext[i].pblk,node) <= 0)
+			return -EIO;
+		const struct extent_header *ch = (const struct extent_header *)node;
+		if(ch->magic != EXTENT_MAGIC || ch->depth != eh->depth - 1 || ch->entries > EXTENTS_PER_BLOCK)
+			return -EIO;
+		if(ext_node_free(ch))
+			return -EIO;
+		release_blkno(ext[i].pblk);
+	}
+	return 0;
+}
+
+// Release pointer block blkno and what it points at, data blocks at depth 0, ptr_cache_lock held
+static int ind_free(int blkno, int depth) {
+	int ptrs[PTRS_PER_BLOCK];
+	struct ptr_block *pb = &ptr_cache[blkno % PTR_CACHE_SLOTS];
+	if(pb->blkno == blkno) {
+		memcpy(ptrs,pb->ptrs,sizeof(ptrs));
+		pb->blkno = 0; // the block is free, its contents must not be written back
+		pb->dirty = 0;
+	} else if(bio_read(blkno,ptrs) <= 0)
+		return -EIO;
+	for(int i = 0; i < (int)PTRS_PER_BLOCK; i++) {
+		if(!ptrs[i])
+			continue;
+		if(depth == 0)
+			release_blkno(ptrs[i]);
+		else if(ind_free(ptrs[i],depth - 1))
+			return -EIO;
+	}
+	release_blkno(blkno);
+	return 0;
+}
+
+/*
+ * Release every block of inode, data and mapping, and leave it with an empty map
+ * The caller writes the inode back
+ */
+int bmap_free(struct inode *inode) {
+	int res = 0;
+	if(inode->type & RUFS_EXTENTS_FL) {
+		res = ext_node_free(&inode->eh);
+	} else {
+		for(int i = 0; i < DIRECT_PTRS; i++)
+			if(inode->direct_ptr[i])
+				release_blkno(inode->direct_ptr[i]);
+		pthread_mutex_lock(&ptr_cache_lock);
+		for(int i = 0; i <= SINGLE_INDIRECT && !res; i++)
+			if(inode->indirect_ptr[i])
+				res = ind_free(inode->indirect_ptr[i],i == SINGLE_INDIRECT);
+		pthread_mutex_unlock(&ptr_cache_lock);
+	}
+	inode_init_map(inode);
+	return res;
+}
+
+/*
+ * dentry cache
+ * Maps (parent ino, name) to the child's inode number, or remembers that the name does not exist
+ * Entries come from a fixed pool that is recycled in FIFO order
+ */
+#define DCACHE_ENTRIES 4096
+#define DCACHE_BUCKETS 8192
+
+struct dentry {
+	uint16_t parent;			// inode number of the directory
+	uint16_t ino;				// inode number of the entry
+	uint8_t negative;			// name is known not to exist
+	uint8_t is_dir;				// entry is a directory
+	uint16_t len;				// length of name, 0 if the slot is unused
+	int next;					// next entry in the hash chain, -1 ends the chain
+	char name[208];
+};
+
+struct dentry dcache[DCACHE_ENTRIES];
+int dcache_bucket[DCACHE_BUCKETS];
+int dcache_next = 0; // pool slot recycled by the next insert
+pthread_rwlock_t dcache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned int dcache_hash(uint16_t parent, const char *name, size_t len) {
+	return fnv1a(FNV1A_INIT ^ parent,name,len) % DCACHE_BUCKETS;
+}
+
+void dcache_init() {
+	pthread_rwlock_wrlock(&dcache_lock);
+	for(int i = 0; i < DCACHE_BUCKETS; i++)
+		dcache_bucket[i] = -1;
+	for(int i = 0; i < DCACHE_ENTRIES; i++) {
+		dcache[i].len = 0;
+		dcache[i].next = -1;
+	}
+	dcache_next = 0;
+	pthread_rwlock_unlock(&dcache_lock);
+}
+
+// Find the entry for name in parent, the caller holds dcache_lock
+static int dcache_find(uint16_t parent, const char *name, size_t len) {
+	for(int i = dcache_bucket[dcache_hash(parent,name,len)]; i != -1; i = dcache[i].next)
+		if(dcache[i].parent == parent && dcache[i].len == len && memcmp(dcache[i].name,name,len) == 0)
+			return i;
+	return -1;
+}
+
+static void dcache_unlink(int i) {
+	int *link = &dcache_bucket[dcache_hash(dcache[i].parent,dcache[i].name,dcache[i].len)];
+	while(*link != i)
+		link = &dcache[*link].next;
+	*link = dcache[i].next;
+	dcache[i].len = 0;
+	dcache[i].next = -1;
+}
+
+/*
+ * Look up name in parent
+ * Returns 1 and fills *ino and *is_dir on a hit, -ENOENT on a negative hit and 0 on a miss
+ */
+int dcache_lookup(uint16_t parent, const char *name, size_t len, uint16_t *ino, int *is_dir) {
+	int res = 0;
+	pthread_rwlock_rdlock(&dcache_lock);
+	int i = dcache_find(parent,name,len);
+	if(i != -1) {
+		if(dcache[i].negative)
+			res = -ENOENT;
+		else {
+			*ino = dcache[i].ino;
+			*is_dir = dcache[i].is_dir;
+			res = 1;
+		}
+	}
+	pthread_rwlock_unlock(&dcache_lock);
+	return res;
+}
+
+// Remember the result of a directory lookup, negative if the name does not exist
+void dcache_insert(uint16_t parent, const char *name, size_t len, uint16_t ino, int is_dir, int negative) {
+	if(len == 0 || len >= sizeof(dcache[0].name))
+		return;
+	pthread_rwlock_wrlock(&dcache_lock);
+	int i = dcache_find(parent,name,len);
+	if(i == -1) {
+		i = dcache_next;
+		dcache_next = (dcache_next + 1) % DCACHE_ENTRIES;
+		if(dcache[i].len)
+			dcache_unlink(i);
+		dcache[i].parent = parent;
+		dcache[i].len = len;
+		memcpy(dcache[i].name,name,len);
+		int *head = &dcache_bucket[dcache_hash(parent,name,len)];
+		dcache[i].next = *head;
+		*head = i;
+	}
+	dcache[i].ino = ino;
+	dcache[i].is_dir = is_dir;
+	dcache[i].negative = negative;
+	pthread_rwlock_unlock(&dcache_lock);
+}
+
+// Forget name in parent, called whenever a directory entry is added or removed
+void dcache_invalidate(uint16_t parent, const char *name, size_t len) {
+	pthread_rwlock_wrlock(&dcache_lock);
+	int i = dcache_find(parent,name,len);
+	if(i != -1)
+		dcache_unlink(i);
+	pthread_rwlock_unlock(&dcache_lock);
+}
+
+/* 
+ * directory operations
+ */
+/*
+ * Directory block helpers
+ * Blocks of RUFS_PACKED_FL directories hold struct dirent_packed records back to back,
+ * the last record's rec_len reaches the end of the block and removals compact the block.
+ * Other directories keep an array of fixed size struct dirent.
+ */
+#define DBLK_PACKED(dir_inode) (((dir_inode)->type & RUFS_PACKED_FL) != 0)
+
+static void dblk_init(unsigned char *block, int packed) {
+	memset(block,0,BLOCK_SIZE);
+	if (packed)
+		((struct dirent_packed *)block)->rec_len = BLOCK_SIZE;
+}
+
+// Returns the offset of the next valid entry at or after *pos and copies it to dirent, or -1
+static int dblk_next(unsigned char *block, int packed, int *pos, struct dirent *dirent) {
+	while (!packed && *pos + sizeof(struct dirent) < BLOCK_SIZE) {
+		int offset = *pos;
+		*pos += sizeof(struct dirent);
+		if (((struct dirent *)(block + offset))->valid) {
+			memcpy(dirent,block + offset,sizeof(struct dirent));
+			return offset;
+		}
+	}
+	while (packed && *pos < BLOCK_SIZE) {
+		struct dirent_packed *de = (struct dirent_packed *)(block + *pos);
+		int offset = *pos;
+		if (de->rec_len < sizeof(struct dirent_packed))
+			return -1; // corrupt record, stop here
+		*pos += de->rec_len;
+		if (de->name_len) {
+			dirent->ino = de->ino;
+			dirent->valid = 1;
+			dirent->len = de->name_len;
+			memcpy(dirent->name,de->name,de->name_len);
+			dirent->name[de->name_len] = '\0';
+			return offset;
+		}
+	}
+	return -1;
+}
+
+// Returns the offset of the valid entry named fname in block, or -1
+static int dblk_find(unsigned char *block, int packed, const char *fname, size_t name_len, struct dirent *dirent) {
+	int offset = 0;
+	while (!packed && offset + sizeof(struct dirent) < BLOCK_SIZE) {
+		struct dirent *dir_entry = (struct dirent *)(block + offset);
+		if (dir_entry->valid && dir_entry->len == name_len && strncmp(dir_entry->name, fname, name_len) == 0) {
+			if (dirent)
+				memcpy(dirent,dir_entry,sizeof(struct dirent));
+			return offset;
+		}
+		offset += sizeof(struct dirent);
+	}
+	while (packed && offset < BLOCK_SIZE) {
+		struct dirent_packed *de = (struct dirent_packed *)(block + offset);
+		if (de->rec_len < sizeof(struct dirent_packed))
+			return -1;
+		if (de->name_len == name_len && memcmp(de->name, fname, name_len) == 0) {
+			if (dirent)
+				dblk_next(block, packed, &offset, dirent);
+			return (char *)de - (char *)block;
+		}
+		offset += de->rec_len;
+	}
+	return -1;
+}
+
+// Returns the offset of the last record of a packed block
+static int dblk_last(unsigned char *block) {
+	int offset = 0;
+	for (;;) {
+		uint16_t rec_len = ((struct dirent_packed *)(block + offset))->rec_len;
+		if (rec_len < sizeof(struct dirent_packed) || offset + rec_len >= BLOCK_SIZE)
+			return offset;
+		offset += rec_len;
+	}
+}
+
+// Bytes an entry takes in a block
+static int dblk_rec_len(int packed, size_t name_len) {
+	return packed ? DIRENT_PACKED_LEN(name_len) : sizeof(struct dirent);
+}
+
+// Bytes of a block that can hold entries
+static int dblk_capacity(int packed) {
+	return packed ? BLOCK_SIZE : (BLOCK_SIZE / sizeof(struct dirent)) * sizeof(struct dirent);
+}
+
+// Returns the offset a new entry would be written to, or -1 if the block is full
+static int dblk_room(unsigned char *block, int packed, size_t name_len) {
+	int offset = 0;
+	while (!packed && offset + sizeof(struct dirent) < BLOCK_SIZE) {
+		if (!((struct dirent *)(block + offset))->valid)
+			return offset;
+		offset += sizeof(struct dirent);
+	}
+	if (!packed)
+		return -1;
+	offset = dblk_last(block);
+	struct dirent_packed *last = (struct dirent_packed *)(block + offset);
+	if (offset == 0 && !last->name_len)
+		return offset; // empty block
+	int used = DIRENT_PACKED_LEN(last->name_len);
+	return BLOCK_SIZE - offset - used >= DIRENT_PACKED_LEN(name_len) ? offset + used : -1;
+}
+
+// Add an entry to a block, returns -1 if it does not fit
+static int dblk_insert(unsigned char *block, int packed, uint16_t f_ino, const char *fname, size_t name_len) {
+	int offset = dblk_room(block, packed, name_len);
+	if (offset < 0)
+		return -1;
+	if (!packed) {
+		struct dirent *dir_entry = (struct dirent *)(block + offset);
+		dir_entry->ino = f_ino;
+		dir_entry->len = name_len;
+		dir_entry->valid = 1;
+		memset(dir_entry->name,0,sizeof(dir_entry->name));
+		memcpy(dir_entry->name,fname,name_len);
+		return 0;
+	}
+	if (offset) { // split the slack off the last record
+		int last = dblk_last(block);
+		((struct dirent_packed *)(block + last))->rec_len = offset - last;
+	}
+	struct dirent_packed *de = (struct dirent_packed *)(block + offset);
+	de->ino = f_ino;
+	de->rec_len = BLOCK_SIZE - offset;
+	de->name_len = name_len;
+	de->file_type = 0;
+	memcpy(de->name,fname,name_len);
+	return 0;
+}
+
+// Point the entry at offset to another inode
+static void dblk_set_ino(unsigned char *block, int packed, int offset, uint16_t f_ino) {
+	if (packed)
+		((struct dirent_packed *)(block + offset))->ino = f_ino;
+	else
+		((struct dirent *)(block + offset))->ino = f_ino;
+}
+
+// Remove the entry at offset, packed blocks slide the following records down over it
+static void dblk_remove(unsigned char *block, int packed, int offset) {
+	if (!packed) {
+		memset(block + offset,0,sizeof(struct dirent));
+		return;
+	}
+	struct dirent_packed *de = (struct dirent_packed *)(block + offset);
+	int rec_len = de->rec_len;
+	if (offset + rec_len < BLOCK_SIZE) {
+		int last = dblk_last(block) - rec_len; // where the last record moves to
+		memmove(block + offset,block + offset + rec_len,BLOCK_SIZE - offset - rec_len);
+		memset(block + BLOCK_SIZE - rec_len,0,rec_len);
+		((struct dirent_packed *)(block + last))->rec_len += rec_len;
+	} else if (offset == 0) {
+		dblk_init(block,packed);
+	} else {
+		int prev = 0;
+		while (prev + ((struct dirent_packed *)(block + prev))->rec_len < offset)
+			prev += ((struct dirent_packed *)(block + prev))->rec_len;
+		((struct dirent_packed *)(block + prev))->rec_len += rec_len;
+		memset(block + offset,0,rec_len);
 	}
-	return ino;
 }
 
-/* 
- * Get available data block number from bitmap
- * Returns -1 if none found
+// Format the first block of a new directory with its . and .. entries
+static void dir_init_block(struct inode *dir_inode, unsigned char *block, uint16_t parent) {
+	if (sb.features & RUFS_FEATURE_PACKED_DIRENT)
+		dir_inode->type |= RUFS_PACKED_FL;
+	dblk_init(block,DBLK_PACKED(dir_inode));
+	dblk_insert(block,DBLK_PACKED(dir_inode),dir_inode->ino,".",1);
+	dblk_insert(block,DBLK_PACKED(dir_inode),parent,"..",2);
+}
+
+// Read logical block lblk of a directory
+static int dir_read_block(struct inode *dir_inode, uint32_t lblk, unsigned char *block, int *pblk) {
+	uint32_t run;
+	*pblk = bmap(dir_inode,lblk,&run);
+	if (*pblk <= 0)
+		return -EIO;
+	return bio_read(*pblk,block) <= 0 ? -EIO : 0;
+}
+
+// Grow a directory by one zeroed block, the caller writes the inode back
+static int dir_append_block(struct inode *dir_inode, uint32_t *lblk, int *pblk) {
+	*lblk = dir_inode->size / BLOCK_SIZE;
+	uint32_t run;
+	int prev = *lblk ? bmap(dir_inode,*lblk - 1,&run) : 0; // keep the directory contiguous
+	*pblk = get_avail_blkno(prev > 0 ? prev + 1 : group_goal(dir_inode->ino));
+	if (*pblk < 0)
+		return -ENOSPC;
+	int res = bmap_set(dir_inode,*lblk,*pblk,1);
+	if (res) {
+		release_blkno(*pblk);
+		return res;
+	}
+	dir_inode->size += BLOCK_SIZE;
+	dir_inode->vstat.st_size = dir_inode->size;
+	return 0;
+}
+
+/*
+ * Hashed directory index (RUFS_INDEX_FL)
+ * Block 0 is the root: a struct dx_header then dx_entry records sorted by hash.
+ * At depth 0 every record points at a leaf block, at depth 1 at an index block
+ * laid out the same way. A leaf holds the entries whose name hash is at least its
+ * record's hash and below the next record's. The first record always has hash 0.
  */
-int get_avail_blkno() {
-	// Step 1: Read data block bitmap from disk
-	if(bio_read(sb.d_bitmap_blk,bmp) <= 0)
-		return -2;
-	int blkno = -1; // stores next availaible data block, if none exist it is 0	
-	// Step 2: Traverse data block bitmap to find an available slot
-	for(int i = 0; i < sb.max_dnum; i++)
-		if(!get_bitmap(bmp,i)) {
-			blkno = i;
-			break;
-		}
-	// Step 3: Update data block bitmap and write to disk 
-	if(blkno != -1) {
-		set_bitmap(bmp,blkno);
-		if(bio_write(sb.d_bitmap_blk,bmp) <= 0)
-			return -2;
+static uint32_t dx_hash(const char *name, size_t len) {
+	return fnv1a(FNV1A_INIT,name,len);
+}
+
+// Returns the index of the last record with hash <= target
+static int dx_search(const struct dx_entry *entries, int count, uint32_t hash) {
+	int lo = 1, hi = count - 1, found = 0;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (entries[mid].hash <= hash) {
+			found = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
 	}
-	return blkno;
+	return found;
 }
 
-/* 
- * inode operations
+// An index node read from disk is only used if its header is sane
+static int dx_node_valid(const unsigned char *node) {
+	const struct dx_header *h = (const struct dx_header *)node;
+	return h->magic == DX_MAGIC && h->count > 0 && h->count <= DX_ENTRIES_PER_BLOCK && h->depth <= 1;
+}
+
+static void dx_init_node(unsigned char *block, int depth) {
+	memset(block,0,BLOCK_SIZE);
+	struct dx_header *h = (struct dx_header *)block;
+	h->magic = DX_MAGIC;
+	h->depth = depth;
+	h->limit = DX_ENTRIES_PER_BLOCK;
+}
+
+static void dx_insert_entry(unsigned char *node, int at, uint32_t hash, uint32_t lblk) {
+	struct dx_header *h = (struct dx_header *)node;
+	struct dx_entry *e = (struct dx_entry *)(h + 1);
+	memmove(&e[at + 1],&e[at],(h->count - at) * sizeof(struct dx_entry));
+	e[at].hash = hash;
+	e[at].lblk = lblk;
+	h->count++;
+}
+
+/*
+ * Index nodes visited on the way from the root to a leaf
  */
-int readi(uint16_t ino, struct inode *inode) {
-	// printf("readi called on ino %d\n",ino);
-	if(ino > sb.max_inum)
-		return 1;
-  // Step 1: Get the inode's on-disk block number
-	const unsigned int blkno = (ino * sizeof(struct inode)) / BLOCK_SIZE + sb.i_start_blk;
-  // Step 2: Get offset of the inode in the inode on-disk block
-	const unsigned int offset = (ino * sizeof(struct inode)) % BLOCK_SIZE;
-  // Step 3: Read the block from disk and then copy into inode structure
-	if(last_inode_blk != blkno) {
-		if(bio_read(blkno,ibmp) <= 0)
+struct dx_path {
+	int levels;						// 1 or 2 index nodes
+	int pblk[2];					// data block of each node
+	int at[2];						// record followed in each node
+	unsigned char node[2][BLOCK_SIZE];
+	uint32_t leaf;					// logical block of the leaf
+};
+
+static int dx_probe(struct inode *dir_inode, uint32_t hash, struct dx_path *path) {
+	if (dir_read_block(dir_inode,0,path->node[0],&path->pblk[0]))
+		return -EIO;
+	struct dx_header *h = (struct dx_header *)path->node[0];
+	if (!dx_node_valid(path->node[0]))
+		return -EIO;
+	path->levels = h->depth + 1;
+	for (int level = 0; level < path->levels; level++) {
+		h = (struct dx_header *)path->node[level];
+		if (level > 0 && (!dx_node_valid(path->node[level]) || h->depth != 0))
+			return -EIO;
+		struct dx_entry *e = (struct dx_entry *)(h + 1);
+		path->at[level] = dx_search(e,h->count,hash);
+		path->leaf = e[path->at[level]].lblk;
+		if (level + 1 < path->levels && dir_read_block(dir_inode,path->leaf,path->node[level + 1],&path->pblk[level + 1]))
 			return -EIO;
-		last_inode_blk = blkno;
 	}
-	memcpy(inode,ibmp + offset,sizeof(struct inode));
-	// printf("readi called on ino %d done\n",ino);
 	return 0;
 }
 
-int writei(uint16_t ino, struct inode *inode) {
-	// printf("writei called on ino %d\n",ino);
-	if(ino > sb.max_inum)
-		return 1;
-	// Step 1: Get the block number where this inode resides on disk
-	const unsigned int blkno = (ino * sizeof(struct inode)) / BLOCK_SIZE + sb.i_start_blk;
-	// Step 2: Get the offset in the block where this inode resides on disk
-	const unsigned int offset = (ino * sizeof(struct inode)) % BLOCK_SIZE;
-	// Step 3: Write inode to disk 
-	if(last_inode_blk != blkno) {
-		if(bio_read(blkno,ibmp) <= 0)
-			return -EIO;
-		last_inode_blk = blkno;
+static int dx_find(struct inode *dir_inode, const char *fname, size_t name_len, struct dirent *dirent) {
+	struct dx_path *path = malloc(sizeof(struct dx_path));
+	unsigned char block[BLOCK_SIZE];
+	int pblk, res;
+	if (!path)
+		return -ENOMEM;
+	res = dx_probe(dir_inode,dx_hash(fname,name_len),path);
+	if (!res)
+		res = dir_read_block(dir_inode,path->leaf,block,&pblk);
+	if (!res) {
+		if (dblk_find(block,DBLK_PACKED(dir_inode),fname,name_len,dirent) < 0)
+			res = -ENOENT;
+	}
+	free(path);
+	return res;
+}
+
+static int dx_cmp_hash(const void *a, const void *b) {
+	uint32_t ha = dx_hash(((const struct dirent *)a)->name,((const struct dirent *)a)->len);
+	uint32_t hb = dx_hash(((const struct dirent *)b)->name,((const struct dirent *)b)->len);
+	return ha < hb ? -1 : ha > hb;
+}
+
+/*
+ * Make room for one more record in the index node above the leaf (path->node[levels - 1])
+ * A full root at depth 0 moves its records to a new index block and becomes depth 1,
+ * a full index block at depth 1 is split in two
+ */
+static int dx_make_room(struct inode *dir_inode, struct dx_path *path) {
+	uint32_t new_lblk;
+	int new_pblk, res;
+	if (((struct dx_header *)path->node[path->levels - 1])->count < DX_ENTRIES_PER_BLOCK)
+		return 0;
+	if (path->levels == 1) {
+		// root is full: push its records down into a new index block, which is split below
+		if ((res = dir_append_block(dir_inode,&new_lblk,&new_pblk)))
+			return res;
+		memcpy(path->node[1],path->node[0],BLOCK_SIZE);
+		dx_init_node(path->node[0],1);
+		dx_insert_entry(path->node[0],0,0,new_lblk);
+		path->pblk[1] = new_pblk;
+		path->at[1] = path->at[0];
+		path->at[0] = 0;
+		path->levels = 2;
 	}
-	memcpy(ibmp + offset,inode,sizeof(struct inode));
-	if(bio_write(blkno,ibmp) <= 0)
+	// index block is full: move its upper half to a new block and record it in the root
+	if (((struct dx_header *)path->node[0])->count >= DX_ENTRIES_PER_BLOCK)
+		return -ENOSPC; // directory has reached its maximum size
+	if ((res = dir_append_block(dir_inode,&new_lblk,&new_pblk)))
+		return res;
+	unsigned char upper[BLOCK_SIZE];
+	struct dx_header *h = (struct dx_header *)path->node[1];
+	struct dx_header *uh = (struct dx_header *)upper;
+	int keep = h->count / 2;
+	dx_init_node(upper,0);
+	uh->count = h->count - keep;
+	memcpy(uh + 1,(struct dx_entry *)(h + 1) + keep,uh->count * sizeof(struct dx_entry));
+	h->count = keep;
+	dx_insert_entry(path->node[0],path->at[0] + 1,((struct dx_entry *)(uh + 1))[0].hash,new_lblk);
+	if (bio_write(path->pblk[1],path->node[1]) <= 0 || bio_write(new_pblk,upper) <= 0 ||
+			bio_write(path->pblk[0],path->node[0]) <= 0)
 		return -EIO;
-	// printf("writei called on ino %d done\n",ino);
+	if (path->at[1] >= keep) { // the leaf's record moved to the new index block
+		memcpy(path->node[1],upper,BLOCK_SIZE);
+		path->pblk[1] = new_pblk;
+		path->at[1] -= keep;
+		path->at[0]++;
+	}
 	return 0;
 }
 
+static int dx_add(struct inode *dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+	unsigned char block[BLOCK_SIZE];
+	int leaf_pblk, res;
+	uint32_t hash = dx_hash(fname,name_len);
+	struct dx_path *path = malloc(sizeof(struct dx_path));
+	if (!path)
+		return -ENOMEM;
+	res = dx_probe(dir_inode,hash,path);
+	if (!res)
+		res = dir_read_block(dir_inode,path->leaf,block,&leaf_pblk);
+	if (res)
+		goto out;
+	// Step 1: Replace a duplicate or use free space in the leaf
+	const int packed = DBLK_PACKED(dir_inode);
+	int offset = dblk_find(block,packed,fname,name_len,NULL);
+	if (offset >= 0 || dblk_insert(block,packed,f_ino,fname,name_len) == 0) {
+		if (offset >= 0)
+			dblk_set_ino(block,packed,offset,f_ino);
+		res = bio_write(leaf_pblk,block) <= 0 ? -EIO : 0;
+		goto out;
+	}
+	// Step 2: The leaf is full, split its entries and the new one by hash
+	struct dirent *all = malloc((BLOCK_SIZE / DIRENT_PACKED_LEN(1) + 1) * sizeof(struct dirent));
+	if (!all) {
+		res = -ENOMEM;
+		goto out;
+	}
+	int n = 0, pos = 0, total = 0;
+	while (dblk_next(block,packed,&pos,&all[n]) >= 0)
+		total += dblk_rec_len(packed,all[n++].len);
+	memset(&all[n],0,sizeof(struct dirent));
+	all[n].ino = f_ino;
+	all[n].valid = 1;
+	all[n].len = name_len;
+	memcpy(all[n].name,fname,name_len);
+	total += dblk_rec_len(packed,all[n++].len);
+	qsort(all,n,sizeof(struct dirent),dx_cmp_hash);
+	// split where the hash changes and both halves fit, as close to the middle as possible
+	int mid = 0, below = 0, m = -1;
+	while (below + dblk_rec_len(packed,all[mid].len) <= total / 2)
+		below += dblk_rec_len(packed,all[mid++].len);
+	for (int d = 0; d < n && m < 0; d++) {
+		for (int side = 0; side < 2 && m < 0; side++) {
+			int at = side ? mid - d : mid + d;
+			if (at <= 0 || at >= n || (side && d == 0))
+				continue;
+			if (dx_hash(all[at].name,all[at].len) == dx_hash(all[at - 1].name,all[at - 1].len))
+				continue;
+			int lower = 0;
+			for (int i = 0; i < at; i++)
+				lower += dblk_rec_len(packed,all[i].len);
+			if (lower <= dblk_capacity(packed) && total - lower <= dblk_capacity(packed))
+				m = at;
+		}
+	}
+	if (m < 0) { // too many names share a hash, cannot split
+		free(all);
+		res = -ENOSPC;
+		goto out;
+	}
+	uint32_t split_hash = dx_hash(all[m].name,all[m].len);
+	uint32_t new_lblk;
+	int new_pblk;
+	if ((res = dx_make_room(dir_inode,path)) || (res = dir_append_block(dir_inode,&new_lblk,&new_pblk))) {
+		free(all);
+		goto out;
+	}
+	unsigned char new_block[BLOCK_SIZE];
+	dblk_init(block,packed);
+	dblk_init(new_block,packed);
+	for (int i = 0; i < n; i++)
+		dblk_insert(i < m ? block : new_block,packed,all[i].ino,all[i].name,all[i].len);
+	free(all);
+	int level = path->levels - 1;
+	dx_insert_entry(path->node[level],path->at[level] + 1,split_hash,new_lblk);
+	if (bio_write(new_pblk,new_block) <= 0 || bio_write(leaf_pblk,block) <= 0 ||
+			bio_write(path->pblk[level],path->node[level]) <= 0)
+		res = -EIO;
+out:
+	free(path);
+	return res;
+}
 
-/* 
- * directory operations
+static int dx_remove(struct inode *dir_inode, const char *fname, size_t name_len) {
+	unsigned char block[BLOCK_SIZE];
+	int pblk, res;
+	struct dx_path *path = malloc(sizeof(struct dx_path));
+	if (!path)
+		return -ENOMEM;
+	res = dx_probe(dir_inode,dx_hash(fname,name_len),path);
+	if (!res)
+		res = dir_read_block(dir_inode,path->leaf,block,&pblk);
+	if (!res) {
+		int offset = dblk_find(block,DBLK_PACKED(dir_inode),fname,name_len,NULL);
+		if (offset < 0)
+			res = -ENOENT;
+		else {
+			dblk_remove(block,DBLK_PACKED(dir_inode),offset);
+			res = bio_write(pblk,block) <= 0 ? -EIO : 0;
+		}
+	}
+	free(path);
+	return res;
+}
+
+/*
+ * Turn a linear directory whose only block is full into an indexed one
+ * Its entries move to a new leaf and block 0 becomes the index root
+ */
+static int dx_convert(struct inode *dir_inode) {
+	unsigned char block[BLOCK_SIZE];
+	int root_pblk, leaf_pblk;
+	uint32_t leaf_lblk;
+	if (dir_read_block(dir_inode,0,block,&root_pblk))
+		return -EIO;
+	int res = dir_append_block(dir_inode,&leaf_lblk,&leaf_pblk);
+	if (res)
+		return res;
+	if (bio_write(leaf_pblk,block) <= 0)
+		return -EIO;
+	dx_init_node(block,0);
+	dx_insert_entry(block,0,0,leaf_lblk);
+	if (bio_write(root_pblk,block) <= 0)
+		return -EIO;
+	dir_inode->type |= RUFS_INDEX_FL;
+	return 0;
+}
+
+/*
+ * Call fn on every block of a directory that holds entries
+ * Indexed directories are walked through the index so index blocks are skipped
  */
+static int dir_walk(struct inode *dir_inode, int (*fn)(unsigned char *block, int packed, void *arg), void *arg) {
+	unsigned char block[BLOCK_SIZE];
+	int pblk, res;
+	if (!(dir_inode->type & RUFS_INDEX_FL)) {
+		for (uint32_t lblk = 0; lblk < dir_inode->size / BLOCK_SIZE; lblk++) {
+			uint32_t run;
+			pblk = bmap(dir_inode, lblk, &run);
+			if (pblk < 0)
+				return -EIO;
+			if (pblk == 0)
+				continue; //hole in the directory, do not search
+			if (bio_read(pblk, block) <= 0)
+				return -EIO;
+			if ((res = fn(block, DBLK_PACKED(dir_inode), arg)))
+				return res;
+		}
+		return 0;
+	}
+	unsigned char *nodes = malloc(2 * BLOCK_SIZE);
+	if (!nodes)
+		return -ENOMEM;
+	res = dir_read_block(dir_inode,0,nodes,&pblk);
+	if (!res && !dx_node_valid(nodes))
+		res = -EIO;
+	struct dx_header *root = (struct dx_header *)nodes;
+	for (int i = 0; !res && i < root->count; i++) {
+		uint32_t lblk = ((struct dx_entry *)(root + 1))[i].lblk;
+		if (root->depth == 0) {
+			if (!(res = dir_read_block(dir_inode,lblk,block,&pblk)))
+				res = fn(block,DBLK_PACKED(dir_inode),arg);
+			continue;
+		}
+		if ((res = dir_read_block(dir_inode,lblk,nodes + BLOCK_SIZE,&pblk)))
+			break;
+		struct dx_header *h = (struct dx_header *)(nodes + BLOCK_SIZE);
+		if (!dx_node_valid(nodes + BLOCK_SIZE) || h->depth != 0) {
+			res = -EIO;
+			break;
+		}
+		for (int k = 0; !res && k < h->count; k++)
+			if (!(res = dir_read_block(dir_inode,((struct dx_entry *)(h + 1))[k].lblk,block,&pblk)))
+				res = fn(block,DBLK_PACKED(dir_inode),arg);
+	}
+	free(nodes);
+	return res;
+}
+
 int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
 	// printf("dir find called on %s\n",fname);
 	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
 	struct inode dir_inode;
+	unsigned char block[BLOCK_SIZE]; // scratch block for bio_read/write
 	if (readi(ino, &dir_inode) != 0)
 		return -EIO; // error: failed to read inode
+	if (dir_inode.type & RUFS_INDEX_FL)
+		return dx_find(&dir_inode, fname, name_len, dirent);
 	
-	// iterate through all direct pointers
-	for (int i = 0; i < 16; i++) {
-		int data_block_idx = dir_inode.direct_ptr[i];
+	// iterate through all blocks of the directory
+	for (uint32_t lblk = 0; lblk < dir_inode.size / BLOCK_SIZE; lblk++) {
+		uint32_t run;
+		int data_block_idx = bmap(&dir_inode, lblk, &run);
+		if (data_block_idx < 0)
+			return -EIO;
 		if (data_block_idx == 0)
-			continue; //empty direct_ptr, do not search
+			continue; //hole in the directory, do not search
 
 		// Step 2: Read directory's data block and check each directory entry.
-		if (bio_read(data_block_idx, bmp) <= 0)
+		if (bio_read(data_block_idx, block) <= 0)
 			return -EIO; // error: failed to read directory data block
 
-		// iterate through directory entries in the data block
-		int offset = 0;
-		while (offset + sizeof(struct dirent) < BLOCK_SIZE) {
-			struct dirent *dir_entry = (struct dirent *)(bmp + offset);
-			if (dir_entry->valid && strncmp(dir_entry->name, fname, name_len) == 0) {
-				memcpy(dirent, dir_entry, sizeof(struct dirent));
-				// printf("dir find called on %s done\n",fname);
-				return 0; // return success, found a matching directory entry
-			}
-			offset += sizeof(struct dirent);
+		if (dblk_find(block, DBLK_PACKED(&dir_inode), fname, name_len, dirent) >= 0) {
+			// printf("dir find called on %s done\n",fname);
+			return 0; // return success, found a matching directory entry
 		}
 	}
 	return -ENOENT; // if code reaches here, no directory/file was found so return error
@@ -157,189 +1739,988 @@ int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *di
 
 int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
 	// printf("dir add called on %s\n",fname);	
-	int need_alloc = 0;  //whether we need to allocate a new block
-	int empty_dptr = -1; //first empty direct entry block
-	int empty_dir_ent = -1; //first empty direct entry
-	struct dirent *dir_entry;
-	for (int i = 0; i < 16; i++) {
-		int data_block_idx = dir_inode.direct_ptr[i];
-		if (data_block_idx == 0) {
-			if(empty_dir_ent == -1 && empty_dptr == -1)  {
-				empty_dptr = i;
-				need_alloc = 1;
-			}
-			continue; //empty direct_ptr, do not search
-		}
+	const uint32_t nblocks = dir_inode.size / BLOCK_SIZE;
+	unsigned char block[BLOCK_SIZE]; // scratch block for bio_read/write
+	int empty_blk = -1; //block holding the first empty directory entry
+	int empty_dir_ent = -1; //first empty directory entry
+	int duplicate = 0; //empty_dir_ent holds fname already
+	int res;
+	if (name_len >= sizeof(((struct dirent *)0)->name))
+		return -ENAMETOOLONG;
+	if (dir_inode.type & RUFS_INDEX_FL) {
+		res = dx_add(&dir_inode, f_ino, fname, name_len);
+		goto WRITE_INODE;
+	}
+	for (uint32_t lblk = 0; lblk < nblocks; lblk++) {
+		uint32_t run;
+		int data_block_idx = bmap(&dir_inode, lblk, &run);
+		if (data_block_idx < 0)
+			return -EIO;
+		if (data_block_idx == 0)
+			continue; //hole in the directory, do not search
 		// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-		if (bio_read(data_block_idx, bmp) <= 0)
+		if (bio_read(data_block_idx, block) <= 0)
 			return -EIO; // error: failed to read directory data block
 
-		// iterate through directory entries in the data block
-		int offset = 0;
-		while (offset + sizeof(struct dirent) < BLOCK_SIZE) {
-			dir_entry = (struct dirent *)(bmp + offset);
-			// Step 2: Check if fname (directory name) is already used in other entries
-			if (!dir_entry->valid && empty_dir_ent == -1) { //empty directory entry found, save for later...
-				empty_dptr = i;
-				empty_dir_ent = offset;
-				need_alloc = 0; //we dont need to allocate any direct pointers (implied in a block)
-			}	
-			if (dir_entry->valid && strncmp(dir_entry->name, fname, name_len) == 0) { //found duplicate, copy over it
-				empty_dptr = i;
-				empty_dir_ent = offset;
-				need_alloc = 0;
-				goto WRITE_DIRENT;
-			}
-			offset += sizeof(struct dirent);
+		// Step 2: Check if fname (directory name) is already used in other entries
+		int offset = dblk_find(block, DBLK_PACKED(&dir_inode), fname, name_len, NULL);
+		if (offset >= 0) { //found duplicate, copy over it
+			empty_blk = data_block_idx;
+			empty_dir_ent = offset;
+			duplicate = 1;
+			break;
+		}
+		if (empty_dir_ent == -1 && (offset = dblk_room(block, DBLK_PACKED(&dir_inode), name_len)) >= 0) { //empty directory entry found, save for later...
+			empty_blk = data_block_idx;
+			empty_dir_ent = offset;
 		}
 	}
-	if(empty_dir_ent == -1 && empty_dptr == -1)
-		return ENOMEM; //no place to add dirent
 	// Step 3: Add directory entry in dir_inode's data block and write to disk
+	if (empty_dir_ent == -1 && nblocks == 1 && (sb.features & RUFS_FEATURE_DIR_INDEX)) {
+		// the directory outgrows its first block, index it from now on
+		res = dx_convert(&dir_inode);
+		if (!res)
+			res = dx_add(&dir_inode, f_ino, fname, name_len);
+		goto WRITE_INODE;
+	}
 	// Allocate a new data block for this directory if it does not exist
-WRITE_DIRENT:
-	if(need_alloc) { //Allocate new datablock for directory
-		dir_inode.direct_ptr[empty_dptr] = get_avail_blkno();
-		dir_inode.size += BLOCK_SIZE;
-		dir_inode.vstat.st_size = dir_inode.size;
-		memset(bmp,0,BLOCK_SIZE);
-		empty_dir_ent = 0;
+	if(empty_dir_ent == -1) { //Allocate new datablock at the end of the directory
+		uint32_t lblk;
+		res = dir_append_block(&dir_inode,&lblk,&empty_blk);
+		if(res)
+			return res; //no place to add dirent
+		dblk_init(block,DBLK_PACKED(&dir_inode));
 	} else {
-		if(bio_read(dir_inode.direct_ptr[empty_dptr],bmp) <= 0)
+		if(bio_read(empty_blk,block) <= 0)
 			return -EIO;
 	}
-	dir_entry = (struct dirent *)(bmp + empty_dir_ent);
-	dir_entry->ino = f_ino;
-	dir_entry->len = name_len;
-	dir_entry->valid = 1;
-	strncpy(dir_entry->name,fname,name_len);
-	if(bio_write(dir_inode.direct_ptr[empty_dptr],bmp) <= 0) // Write temp block to file
+	if(duplicate)
+		dblk_set_ino(block,DBLK_PACKED(&dir_inode),empty_dir_ent,f_ino);
+	else
+		dblk_insert(block,DBLK_PACKED(&dir_inode),f_ino,fname,name_len);
+	if(bio_write(empty_blk,block) <= 0) // Write temp block to file
 		return -EIO; 
-	// Update directory inode
+	res = 0;
+WRITE_INODE:
+	// Update directory inode, an index split may have grown it even if the add failed
+	dcache_invalidate(dir_inode.ino,fname,name_len);
 	dir_inode.vstat.st_mtime = time(NULL);
-	int res = writei(dir_inode.ino,&dir_inode);
-	if(res)
-		return res;
+	int err = writei(dir_inode.ino,&dir_inode);
 	// printf("dir add called on %s done\n",fname);	
-	return 0;
+	return res ? res : err;
 }
 
 // Required for 518
 int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+	unsigned char block[BLOCK_SIZE]; // scratch block for bio_read/write
+	int res = -ENOENT;
+	if (dir_inode.type & RUFS_INDEX_FL) {
+		res = dx_remove(&dir_inode, fname, name_len);
+		goto UPDATE_INODE;
+	}
+	for (uint32_t lblk = 0; lblk < dir_inode.size / BLOCK_SIZE; lblk++) {
+		uint32_t run;
+		int data_block_idx = bmap(&dir_inode, lblk, &run);
+		if (data_block_idx < 0)
+			return -EIO;
+		if (data_block_idx == 0)
+			continue; //hole in the directory, do not search
+		// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+		if (bio_read(data_block_idx, block) <= 0)
+			return -EIO;
+		// Step 2: Check if fname exist
+		int offset = dblk_find(block, DBLK_PACKED(&dir_inode), fname, name_len, NULL);
+		if (offset >= 0) {
+			// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+			dblk_remove(block, DBLK_PACKED(&dir_inode), offset);
+			res = bio_write(data_block_idx, block) <= 0 ? -EIO : 0;
+			break;
+		}
+	}
+UPDATE_INODE:
+	if (res)
+		return res;
+	dcache_invalidate(dir_inode.ino, fname, name_len);
+	dir_inode.vstat.st_mtime = time(NULL);
+	return writei(dir_inode.ino, &dir_inode);
+}
+
+/* 
+ * namei operation
+ */
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+	// printf("getting node by path on %s\n",path);
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	// Each component is a dentry cache probe, directories are only searched on a miss
+	const char *name = path;
+	int is_dir = 1;
+	while (1) {
+		// split off the next component between "/" delimiters
+		while (*name == '/')
+			name++;
+		if (*name == '\0')
+			break;
+		const char *end = strchr(name, '/');
+		size_t len = end ? (size_t)(end - name) : strlen(name);
+		// only directories can be traversed further
+		if (!is_dir)
+			return -ENOTDIR;
+		uint16_t child;
+		int hit = dcache_lookup(ino, name, len, &child, &is_dir);
+		stats_count(hit ? SC_DCACHE_HIT : SC_DCACHE_MISS, 1);
+		if (hit < 0)
+			return -ENOENT;
+		if (hit == 0) {
+			// find the directory entry for the current component and remember the result
+			struct dirent dirent;
+			int dir_find_result = dir_find(ino, name, len, &dirent);
+			if (dir_find_result == -ENOENT)
+				dcache_insert(ino, name, len, 0, 0, 1);
+			if (dir_find_result != 0)
+				return dir_find_result;
+			// read the inode corresponding to the directory entry
+			if (readi(dirent.ino, inode) != 0)
+				return -EIO;
+			child = dirent.ino;
+			is_dir = S_ISDIR(inode->vstat.st_mode);
+			dcache_insert(ino, name, len, child, is_dir, 0);
+		}
+		// update ino to the inode of the current directory entry
+		ino = child;
+		name += len;
+	}
+    
+    // read the inode of the terminal point to struct inode *inode
+    if (readi(ino, inode) != 0) {
+        return -EIO; //return error if unsuccessful
+    }
+	// printf("getting node by path on %s done\n",path);
+	return 0;
+}
+
+/*
+ * locking
+ * Lock order: journal_lock, namespace_lock, then inode locks (parent before child),
+ * then ptr_cache_lock, icache_lock and the group locks (one at a time)
+ */
+void inode_lock(uint16_t ino, int exclusive) {
+	if(exclusive)
+		pthread_rwlock_wrlock(&inode_locks[ino]);
+	else
+		pthread_rwlock_rdlock(&inode_locks[ino]);
+}
+
+void inode_unlock(uint16_t ino) {
+	pthread_rwlock_unlock(&inode_locks[ino]);
+}
+
+/*
+ * Resolve path and lock its inode, shared or exclusive
+ * The inode is re-read once the lock is held so it cannot be stale
+ */
+int get_locked_node(const char *path, int exclusive, struct inode *inode) {
+	pthread_rwlock_rdlock(&namespace_lock);
+	int res = get_node_by_path(path,0,inode);
+	pthread_rwlock_unlock(&namespace_lock);
+	if(res)
+		return res;
+	inode_lock(inode->ino,exclusive);
+	if(readi(inode->ino,inode)) {
+		inode_unlock(inode->ino);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Write buffer with delayed allocation
+ * write only copies into per-inode pages. Data blocks are allocated and written when the
+ * pages are flushed: on flush, release and fsync, by the commit thread, or once an inode
+ * holds WBUF_INODE_PAGES pages. Once all inodes together hold WBUF_MAX_PAGES, handle_stop
+ * has the commit thread write back every buffer.
+ * A page without a data block reserves one when it is created, so write fails with
+ * -ENOSPC instead of a later flush finding no room for it.
+ * Pages are sorted by logical block and protected by the inode lock.
+ */
+#define WBUF_INODE_PAGES 256
+#define WBUF_MAX_PAGES 4096
+
+struct wpage {
+	uint32_t lblk;
+	unsigned char *data;
+};
+
+struct wbuf {
+	uint32_t count;					// pages in use, also read without the inode lock (atomic)
+	uint32_t cap;
+	uint32_t reserved;				// pages that have no data block yet
+	struct wpage *pages;
+};
+
+static struct wbuf *wbufs; // one per inode
+static int wbuf_pages = 0; // pages buffered over all inodes (atomic)
+static int wbuf_reserved = 0; // data blocks reserved over all inodes (atomic)
+
+// Reserve n data blocks for new pages, returns -1 if the free blocks are all reserved
+static int wbuf_reserve(int n) {
+	long free_blocks = 0;
+	for(int g = 0; g < sb.groups; g++)
+		free_blocks += __atomic_load_n(&groups[g].gd.free_blocks,__ATOMIC_RELAXED);
+	int reserved = __atomic_load_n(&wbuf_reserved,__ATOMIC_RELAXED);
+	do {
+		if(reserved + n > free_blocks)
+			return -1;
+	} while(!__atomic_compare_exchange_n(&wbuf_reserved,&reserved,reserved + n,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+	return 0;
+}
+
+// Returns the index of the first page at or after lblk
+static uint32_t wbuf_search(const struct wbuf *wb, uint32_t lblk) {
+	uint32_t lo = 0, hi = wb->count;
+	while(lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if(wb->pages[mid].lblk < lblk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Returns the buffered page of lblk, or NULL
+static unsigned char *wbuf_find(const struct wbuf *wb, uint32_t lblk) {
+	uint32_t i = wbuf_search(wb,lblk);
+	return i < wb->count && wb->pages[i].lblk == lblk ? wb->pages[i].data : NULL;
+}
+
+// Returns the buffered page of lblk, adding a new page if there is none
+static unsigned char *wbuf_get(struct wbuf *wb, uint32_t lblk, int *created) {
+	uint32_t i = wbuf_search(wb,lblk);
+	*created = 0;
+	if(i < wb->count && wb->pages[i].lblk == lblk)
+		return wb->pages[i].data;
+	if(wb->count == wb->cap) {
+		uint32_t cap = wb->cap ? wb->cap * 2 : 16;
+		struct wpage *pages = realloc(wb->pages,cap * sizeof(struct wpage));
+		if(!pages)
+			return NULL;
+		wb->pages = pages;
+		wb->cap = cap;
+	}
+	unsigned char *data = malloc(BLOCK_SIZE);
+	if(!data)
+		return NULL;
+	memmove(&wb->pages[i + 1],&wb->pages[i],(wb->count - i) * sizeof(struct wpage));
+	wb->pages[i].lblk = lblk;
+	wb->pages[i].data = data;
+	__atomic_store_n(&wb->count,wb->count + 1,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&wbuf_pages,1,__ATOMIC_RELAXED);
+	*created = 1;
+	return data;
+}
+
+static void wbuf_drop(struct wbuf *wb) {
+	for(uint32_t i = 0; i < wb->count; i++)
+		free(wb->pages[i].data);
+	__atomic_sub_fetch(&wbuf_pages,wb->count,__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&wbuf_reserved,wb->reserved,__ATOMIC_RELAXED);
+	wb->reserved = 0;
+	__atomic_store_n(&wb->count,0,__ATOMIC_RELAXED);
+	free(wb->pages);
+	wb->pages = NULL;
+	wb->cap = 0;
+}
+
+// Copy the buffered pages that overlap [offset, offset + size) over buffer
+static void wbuf_overlay(const struct wbuf *wb, char *buffer, size_t size, off_t offset) {
+	for(uint32_t i = wbuf_search(wb,offset / BLOCK_SIZE); i < wb->count; i++) {
+		off_t start = (off_t)wb->pages[i].lblk * BLOCK_SIZE;
+		if(start >= offset + (off_t)size)
+			break;
+		off_t from = start > offset ? start : offset;
+		off_t to = start + BLOCK_SIZE < offset + (off_t)size ? start + BLOCK_SIZE : offset + (off_t)size;
+		memcpy(buffer + (from - offset),wb->pages[i].data + (from - start),to - from);
+	}
+}
+
+// Allocation goal for the unmapped pages: right after the block before the first of them
+static int wbuf_goal(struct inode *inode, const struct wbuf *wb, const int *pblks) {
+	uint32_t i = 0, run;
+	while(i < wb->count && pblks[i])
+		i++;
+	int prev = (i < wb->count && wb->pages[i].lblk) ? bmap(inode,wb->pages[i].lblk - 1,&run) : 0;
+	return prev > 0 ? prev + 1 : group_goal(inode->ino);
+}
+
+// Allocate and write every buffered page of inode, the caller holds the inode lock exclusively
+// Pages that could not be allocated or written stay buffered
+static int wbuf_flush(struct inode *inode) {
+	struct wbuf *wb = &wbufs[inode->ino];
+	const int count = wb->count;
+	int res = 0;
+	if(count == 0)
+		return 0;
+	int *pblks = malloc(count * sizeof(int)); // data block of each page, 0 if it has none, -1 once written
+	int *new_blknos = malloc(count * sizeof(int));
+	struct iovec *iov = malloc(count * sizeof(struct iovec));
+	if(!pblks || !new_blknos || !iov) {
+		res = -ENOMEM;
+		goto out;
+	}
+	// Step 1: Allocate the unmapped pages in one pass so they come out contiguous
+	int nmissing = 0;
+	for(int i = 0; i < count; i++) {
+		uint32_t run;
+		pblks[i] = bmap(inode,wb->pages[i].lblk,&run);
+		if(pblks[i] < 0) {
+			res = -EIO;
+			goto out;
+		}
+		if(pblks[i] == 0)
+			nmissing++;
+	}
+	int nnew = nmissing ? get_avail_blknos(nmissing,new_blknos,wbuf_goal(inode,wb,pblks)) : 0;
+	if(nnew < nmissing) {
+		nnew = 0; // the unmapped pages wait for blocks to be freed
+		res = -ENOSPC;
+	}
+	// Map each run of pages on consecutive logical and data blocks with one bmap_set
+	for(int i = 0, next_new = 0; i < count && next_new < nnew; ) {
+		if(pblks[i]) {
+			i++;
+			continue;
+		}
+		int len = 1;
+		while(i + len < count && next_new + len < nnew && !pblks[i + len] &&
+				wb->pages[i + len].lblk == wb->pages[i].lblk + len &&
+				new_blknos[next_new + len] == new_blknos[next_new] + len)
+			len++;
+		int err = bmap_set(inode,wb->pages[i].lblk,new_blknos[next_new],len);
+		if(err) { // the file cannot grow past this point
+			while(next_new < nnew)
+				release_blkno(new_blknos[next_new++]);
+			res = err;
+			break;
+		}
+		for(int k = 0; k < len; k++)
+			pblks[i + k] = new_blknos[next_new + k];
+		i += len;
+		next_new += len;
+	}
+	// Step 2: Write each run of pages on consecutive data blocks with one vectored write
+	for(int i = 0; i < count; ) {
+		if(pblks[i] <= 0) {
+			i++;
+			continue;
+		}
+		int n = 0;
+		do {
+			iov[n].iov_base = wb->pages[i + n].data;
+			iov[n].iov_len = BLOCK_SIZE;
+			n++;
+		} while(i + n < count && pblks[i + n] == pblks[i] + n);
+		if(bio_writev(pblks[i],iov,n) < 0)
+			res = -EIO;
+		else
+			for(int k = 0; k < n; k++)
+				pblks[i + k] = -1;
+		i += n;
+	}
+	// Step 3: Drop the pages that are on disk and store the new block map
+	int kept = 0, unmapped = 0;
+	for(int i = 0; i < count; i++) {
+		if(pblks[i] < 0) {
+			free(wb->pages[i].data);
+			continue;
+		}
+		if(pblks[i] == 0)
+			unmapped++;
+		wb->pages[kept++] = wb->pages[i];
+	}
+	__atomic_sub_fetch(&wbuf_pages,count - kept,__ATOMIC_RELAXED);
+	__atomic_store_n(&wb->count,kept,__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&wbuf_reserved,wb->reserved - unmapped,__ATOMIC_RELAXED); // now allocated
+	wb->reserved = unmapped;
+	if(kept == 0)
+		wbuf_drop(wb);
+	if(writei(inode->ino,inode))
+		res = -EIO;
+out:
+	free(pblks);
+	free(new_blknos);
+	free(iov);
+	return res;
+}
+
+/*
+ * Journal space
+ * A commit has to fit in one journal transaction. Operations commit once the pending
+ * metadata reaches half of the journal (handle_stop) and wait for a commit at 3/4
+ * (handle_start), the block cache refuses to hold more dirty blocks than the journal takes.
+ */
+#define JOURNAL_COMMIT_AT(capacity) ((capacity) / 2)
+#define JOURNAL_FORCE_AT(capacity) ((capacity) * 3 / 4)
+
+// Most blocks the next commit writes: the dirty cached blocks and the inode table,
+// bitmap and descriptor blocks still to be written back
+static int journal_pending(void) {
+	return bio_dirty(NULL,0) + __atomic_load_n(&icache_dirty,__ATOMIC_RELAXED) +
+		__atomic_load_n(&bitmaps_dirty,__ATOMIC_RELAXED) + (__atomic_load_n(&gdt_dirty,__ATOMIC_RELAXED) ? gdt_blocks() : 0);
+}
+
+// Write the dirty inodes and bitmaps and commit them with the dirty blocks, journal_lock held exclusively
+// Nothing is committed unless both made it into the block cache, the rest stays dirty for the next try
+static int sync_commit(void) {
+	int res = 0;
+	if(icache_flush())
+		res = -EIO;
+	if(bitmaps_flush())
+		res = -EIO;
+	if(res)
+		return res;
+	if(journal_on ? journal_commit() : bio_flush())
+		res = -EIO;
+	return res;
+}
+
+// Between the inodes rufs_sync_all writes: commit early when the rest might not fit any more
+// Every inode is complete at that point, so each transaction is consistent on its own
+static int sync_make_room(void) {
+	if(!journal_on || journal_pending() < JOURNAL_FORCE_AT(journal_capacity()))
+		return 0;
+	return sync_commit();
+}
+
+// Flush the write buffers of all inodes, journal_lock held exclusively
+static int wbuf_flush_all(void) {
+	int res = 0;
+	for(int ino = 0; ino < sb.max_inum; ino++) {
+		if(!__atomic_load_n(&wbufs[ino].count,__ATOMIC_RELAXED))
+			continue;
+		struct inode inode;
+		inode_lock(ino,1);
+		if(readi(ino,&inode) == 0) {
+			if(wbuf_flush(&inode))
+				res = -EIO;
+		} else
+			res = -EIO;
+		inode_unlock(ino);
+		if(sync_make_room())
+			res = -EIO;
+	}
+	return res;
+}
+
+/*
+ * Lazy access times
+ * Reads only record the new atime in lazy_atime, the commit thread, fsync and unmount
+ * write all of them back together
+ */
+// Note an access to inode, following the atime mount option
+static void inode_touch_atime(const struct inode *inode) {
+	if(rufs_opts.atime == ATIME_NOATIME)
+		return;
+	time_t now = time(NULL);
+	time_t atime = inode->vstat.st_atime;
+	if(rufs_opts.atime == ATIME_RELATIME && atime > inode->vstat.st_mtime &&
+			atime > inode->vstat.st_ctime && now - atime < 24 * 60 * 60)
+		return; // relatime: only once a day unless modified since the last access
+	if(atime < now)
+		__atomic_store_n(&lazy_atime[inode->ino],now,__ATOMIC_RELAXED);
+}
+
+// Write every pending access time to the inode table, journal_lock held exclusively
+static int lazy_atime_flush(void) {
+	int res = 0;
+	for(int ino = 0; ino < sb.max_inum; ino++) {
+		if(!__atomic_load_n(&lazy_atime[ino],__ATOMIC_RELAXED))
+			continue;
+		struct inode inode;
+		inode_lock(ino,1);
+		time_t atime = __atomic_exchange_n(&lazy_atime[ino],0,__ATOMIC_RELAXED);
+		if(readi(ino,&inode) == 0 && inode.valid) {
+			if(atime > inode.vstat.st_atime)
+				inode.vstat.st_atime = atime;
+			if(writei(ino,&inode))
+				res = -EIO;
+		}
+		inode_unlock(ino);
+		if(sync_make_room())
+			res = -EIO;
+	}
+	return res;
+}
+
+// Write back buffered file data, all dirty metadata and cached blocks
+// With the journal the metadata is written as one transaction that holds every operation
+// completed since the last commit (group commit)
+static int rufs_sync_all(void) {
+	pthread_rwlock_wrlock(&journal_lock); // wait for operations in progress
+	int res = wbuf_flush_all();
+	if(lazy_atime_flush())
+		res = -EIO;
+	if(sync_commit())
+		res = -EIO;
+	pthread_rwlock_unlock(&journal_lock);
+	return res;
+}
+
+/*
+ * Commit thread, writes back dirty state every rufs_opts.commit seconds
+ * or earlier when the journal is filling up
+ */
+static pthread_t commit_thread;
+static int commit_running = 0;
+static int commit_wanted = 0;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+
+static void *commit_main(void *arg) {
+	pthread_mutex_lock(&commit_lock);
+	while(commit_running) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME,&deadline);
+		deadline.tv_sec += rufs_opts.commit;
+		while(commit_running && !commit_wanted)
+			if(pthread_cond_timedwait(&commit_cond,&commit_lock,&deadline) == ETIMEDOUT)
+				break;
+		if(!commit_running)
+			break; // woken up to stop
+		commit_wanted = 0;
+		pthread_mutex_unlock(&commit_lock);
+		rufs_sync_all();
+		pthread_mutex_lock(&commit_lock);
+	}
+	pthread_mutex_unlock(&commit_lock);
+	return NULL;
+}
+
+static void commit_start(void) {
+	if(rufs_opts.commit <= 0)
+		return;
+	commit_running = 1;
+	if(pthread_create(&commit_thread,NULL,commit_main,NULL))
+		commit_running = 0; // no periodic write-back, fsync and unmount still write
+}
+
+static void commit_stop(void) {
+	pthread_mutex_lock(&commit_lock);
+	int running = commit_running;
+	commit_running = 0;
+	pthread_cond_signal(&commit_cond);
+	pthread_mutex_unlock(&commit_lock);
+	if(running)
+		pthread_join(commit_thread,NULL);
+}
+
+/*
+ * Journal handles
+ * An operation that changes metadata runs between handle_start() and handle_stop(),
+ * so a commit never sees it half done. Handles do not nest.
+ */
+static void handle_start(void) {
+	// Never start on a nearly full transaction, the journal could not take it
+	if(journal_on && journal_pending() >= JOURNAL_FORCE_AT(journal_capacity()))
+		rufs_sync_all();
+	pthread_rwlock_rdlock(&journal_lock);
+}
+
+static void handle_stop(void) {
+	pthread_rwlock_unlock(&journal_lock);
+	// Commit before the transaction outgrows the journal or the write buffers of other
+	// inodes hold too much memory
+	if((!journal_on || journal_pending() < JOURNAL_COMMIT_AT(journal_capacity())) &&
+			__atomic_load_n(&wbuf_pages,__ATOMIC_RELAXED) < WBUF_MAX_PAGES)
+		return;
+	pthread_mutex_lock(&commit_lock);
+	int running = commit_running;
+	if(running) {
+		commit_wanted = 1;
+		pthread_cond_signal(&commit_cond);
+	}
+	pthread_mutex_unlock(&commit_lock);
+	if(!running)
+		rufs_sync_all();
+}
+
+/*
+ * Open file table
+ * fi->fh indexes open_files. Each slot holds an iget reference, so I/O through a handle
+ * needs no path walk and its inode and block map are served from the inode cache.
+ * A handle of the statistics file holds its snapshot instead and has no inode.
+ */
+#define MAX_OPEN_FILES 4096
+
+struct open_file {
+	int used;
+	uint16_t ino;
+	struct inode *inode;			// iget reference, NULL if the inode cache was full
+	off_t ra_next;					// offset a sequential read continues at
+	uint32_t ra_window;				// readahead window in blocks, 0 after random reads
+	uint32_t ra_end;				// logical block readahead has been issued up to
+	struct stats_snapshot *stats;	// snapshot of the statistics file, NULL for inodes
+};
+
+static struct open_file open_files[MAX_OPEN_FILES];
+static int open_files_hint = 0;
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Take a free slot for the handle and store its index in fi->fh
+static int ofile_store(uint16_t ino, struct inode *inode, struct stats_snapshot *stats, struct fuse_file_info *fi) {
+	pthread_mutex_lock(&open_files_lock);
+	for(int i = 0; i < MAX_OPEN_FILES; i++) {
+		int slot = (open_files_hint + i) % MAX_OPEN_FILES;
+		if(!open_files[slot].used) {
+			open_files[slot].used = 1;
+			open_files[slot].ino = ino;
+			open_files[slot].inode = inode;
+			open_files[slot].ra_next = 0;
+			open_files[slot].ra_window = 0;
+			open_files[slot].ra_end = 0;
+			open_files[slot].stats = stats;
+			open_files_hint = slot + 1;
+			pthread_mutex_unlock(&open_files_lock);
+			fi->fh = slot;
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&open_files_lock);
+	return -ENFILE;
+}
+
+// Store a handle for ino in fi->fh
+static int ofile_open(uint16_t ino, struct fuse_file_info *fi) {
+	struct inode *inode = iget(ino);
+	int res = ofile_store(ino,inode,NULL,fi);
+	if(res && inode)
+		iput(inode);
+	return res;
+}
+
+// Returns the inode number behind fi->fh, or -1 if fi is not an open handle
+static int ofile_ino(struct fuse_file_info *fi) {
+	if(!fi || fi->fh >= MAX_OPEN_FILES)
+		return -1;
+	pthread_mutex_lock(&open_files_lock);
+	int ino = open_files[fi->fh].used && !open_files[fi->fh].stats ? open_files[fi->fh].ino : -1;
+	pthread_mutex_unlock(&open_files_lock);
+	return ino;
+}
+
+// Returns 1 if ino has an open handle
+static int ofile_busy(uint16_t ino) {
+	int busy = 0;
+	pthread_mutex_lock(&open_files_lock);
+	for(int i = 0; i < MAX_OPEN_FILES && !busy; i++)
+		busy = open_files[i].used && !open_files[i].stats && open_files[i].ino == ino;
+	pthread_mutex_unlock(&open_files_lock);
+	return busy;
+}
+
+static void ofile_close(struct fuse_file_info *fi) {
+	struct inode *inode = NULL;
+	struct stats_snapshot *stats = NULL;
+	if(!fi || fi->fh >= MAX_OPEN_FILES)
+		return;
+	pthread_mutex_lock(&open_files_lock);
+	if(open_files[fi->fh].used) {
+		open_files[fi->fh].used = 0;
+		inode = open_files[fi->fh].inode;
+		stats = open_files[fi->fh].stats;
+	}
+	pthread_mutex_unlock(&open_files_lock);
+	if(inode)
+		iput(inode);
+	free(stats);
+}
+
+// Lock and read the inode of an open handle, or resolve path if there is none
+static int get_locked_file(const char *path, struct fuse_file_info *fi, int exclusive, struct inode *inode) {
+	int ino = ofile_ino(fi);
+	if(ino < 0)
+		return path ? get_locked_node(path,exclusive,inode) : -EBADF;
+	inode_lock(ino,exclusive);
+	if(readi(ino,inode)) {
+		inode_unlock(ino);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Sequential readahead
+ * Each handle tracks where the next sequential read would start. Sequential reads double
+ * the window up to rufs_opts.readahead blocks and the blocks ahead of the reader are
+ * loaded into the block cache, by the readahead thread unless sync_readahead is set.
+ */
+#define RA_MIN_WINDOW 8
+#define RA_QUEUE 64
+
+struct ra_request {
+	int pblk;
+	int count;
+};
+
+static struct ra_request ra_queue[RA_QUEUE];
+static int ra_head = 0, ra_tail = 0;	// ra_head == ra_tail when empty
+static int ra_running = 0;
+static pthread_t ra_thread;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+
+static void *ra_main(void *arg) {
+	pthread_mutex_lock(&ra_lock);
+	while(ra_running) {
+		if(ra_head == ra_tail) {
+			pthread_cond_wait(&ra_cond,&ra_lock);
+			continue;
+		}
+		struct ra_request req = ra_queue[ra_head];
+		ra_head = (ra_head + 1) % RA_QUEUE;
+		pthread_mutex_unlock(&ra_lock);
+		bio_prefetch(req.pblk,req.count);
+		pthread_mutex_lock(&ra_lock);
+	}
+	pthread_mutex_unlock(&ra_lock);
+	return NULL;
+}
 
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	
-	// Step 2: Check if fname exist
+static void ra_start(void) {
+	ra_head = ra_tail = 0;
+	if(rufs_opts.readahead <= 0 || rufs_opts.sync_readahead)
+		return;
+	ra_running = 1;
+	if(pthread_create(&ra_thread,NULL,ra_main,NULL))
+		ra_running = 0; // readahead falls back to the reading thread
+}
 
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+static void ra_stop(void) {
+	pthread_mutex_lock(&ra_lock);
+	int running = ra_running;
+	ra_running = 0;
+	pthread_cond_signal(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+	if(running)
+		pthread_join(ra_thread,NULL);
+}
 
-	return 0;
+// Prefetch count blocks at pblk, requests are dropped while the queue is full
+static void ra_submit(int pblk, int count) {
+	pthread_mutex_lock(&ra_lock);
+	if(!ra_running) {
+		pthread_mutex_unlock(&ra_lock);
+		bio_prefetch(pblk,count);
+		return;
+	}
+	if((ra_tail + 1) % RA_QUEUE != ra_head) {
+		ra_queue[ra_tail].pblk = pblk;
+		ra_queue[ra_tail].count = count;
+		ra_tail = (ra_tail + 1) % RA_QUEUE;
+		pthread_cond_signal(&ra_cond);
+	}
+	pthread_mutex_unlock(&ra_lock);
 }
 
-/* 
- * namei operation
- */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	// printf("getting node by path on %s\n",path);
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	
-	// tokenize the path with "/"delimiter
-    char *token;
-    char *path_copy = malloc(strlen(path) + 1);
-	if(!path_copy)
-		exit(EXIT_FAILURE);
-    strcpy(path_copy, path);
-    token = strtok(path_copy, "/");
-	// printf("token: /\n");
-	// traverse the path
-    while (token != NULL) {
-		// printf("token: %s\n",token);
-        // find the directory entry for the current token
-        struct dirent dirent;
-        int dir_find_result = dir_find(ino, token, strlen(token), &dirent);
-        
-        // check if the directory entry was found
-        if (dir_find_result != 0) {
-            free(path_copy);
-			return -ENOENT;
-        }
-        
-        // read the inode corresponding to the directory entry
-        if (readi(dirent.ino, inode) != 0) {
-			free(path_copy);
-			return -EIO;
-        }
-        // move to the next token
-        token = strtok(NULL, "/");
-        
-        // if token is not NULL and inode is not a directory, return error.
-		//  this means that we aren't at the end of the path(token != null), but the inode 
-		//  is not a directory, so we can't traverse further
-        if (token != NULL && !S_ISDIR(inode->vstat.st_mode)) { //S_ISDIR vs S_IFDIR?
-            // Next token is not NULL but current inode is not a directory
-            free(path_copy);
-			return ENOTDIR;
-        }
-        
-        // update ino to the inode of the current directory entry
-        ino = dirent.ino;
-    }
-    
-    // read the inode of the terminal point to struct inode *inode
-    if (readi(ino, inode) != 0) {
-		free(path_copy);
-        return -EIO; //return error if unsuccessful
-    }
-	// printf("getting node by path on %s done\n",path);
-	free(path_copy);
-	return 0;
+// Called after a read of len bytes at offset through fi, the caller holds the inode lock
+static void ofile_readahead(struct fuse_file_info *fi, struct inode *inode, off_t offset, size_t len) {
+	if(rufs_opts.readahead <= 0 || ofile_ino(fi) != inode->ino)
+		return;
+	const uint32_t nblocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	const uint32_t next = (offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t from, to;
+	// Step 1: Grow the window on sequential reads, drop it on random ones
+	pthread_mutex_lock(&open_files_lock);
+	struct open_file *of = &open_files[fi->fh];
+	if(offset == of->ra_next) {
+		of->ra_window = of->ra_window ? of->ra_window * 2 : RA_MIN_WINDOW;
+		if(of->ra_window > rufs_opts.readahead)
+			of->ra_window = rufs_opts.readahead;
+	} else {
+		of->ra_window = 0;
+		of->ra_end = 0;
+	}
+	of->ra_next = offset + len;
+	// Step 2: Issue the next part of the window once half of what was issued is consumed
+	from = of->ra_end > next ? of->ra_end : next;
+	to = next + of->ra_window;
+	if(to > nblocks)
+		to = nblocks;
+	if(of->ra_window == 0 || from >= to || of->ra_end >= next + of->ra_window / 2)
+		to = from;
+	else
+		of->ra_end = to;
+	pthread_mutex_unlock(&open_files_lock);
+	// Step 3: Prefetch every mapped run in [from, to)
+	while(from < to) {
+		uint32_t run;
+		int pblk = bmap(inode,from,&run);
+		if(pblk < 0 || run == 0)
+			break;
+		if(run > to - from)
+			run = to - from;
+		if(pblk > 0)
+			ra_submit(pblk,run);
+		from += run;
+	}
 }
 
 
+
 /* 
  * Make file system
+ * size is the bytes on the disk, inode_ratio the bytes of disk per inode,
+ * blocks_per_group the blocks in each block group (0 for as many as one bitmap block covers)
+ * and journal_blocks the size of the journal (-1 for 1/16 of the disk, 0 for none),
+ * block_size has to be the BLOCK_SIZE rufs was built with
+ */
+#define MKFS_THREADS 8
+
+struct itable_zero {
+	int next;		// next group to clear (atomic)
+	int err;		// a group failed (atomic)
+};
+
+static void *itable_zero_main(void *arg) {
+	struct itable_zero *z = arg;
+	const int nblocks = sb.inodes_per_group / (BLOCK_SIZE / sizeof(struct inode));
+	int g;
+	while((g = __atomic_fetch_add(&z->next,1,__ATOMIC_RELAXED)) < sb.groups)
+		if(bio_zero_range(groups[g].gd.inode_table,nblocks))
+			__atomic_store_n(&z->err,1,__ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * Clear the inode tables of every group, up to one thread per CPU
+ * A new disk file is sparse and reads as zeros, only a reused one needs this
  */
-int rufs_mkfs() {
+static int itables_zero() {
+	pthread_t threads[MKFS_THREADS];
+	struct itable_zero z = { 0, 0 };
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int n = ncpu < 1 ? 1 : (ncpu > MKFS_THREADS ? MKFS_THREADS : ncpu);
+	if(n > sb.groups)
+		n = sb.groups;
+	int started = 0;
+	while(started < n && pthread_create(&threads[started],NULL,itable_zero_main,&z) == 0)
+		started++;
+	if(started == 0)
+		itable_zero_main(&z);
+	for(int i = 0; i < started; i++)
+		pthread_join(threads[i],NULL);
+	return z.err ? -EIO : 0;
+}
+
+int rufs_mkfs(off_t size, int block_size, int inode_ratio, int blocks_per_group, int journal_blocks) {
 	// printf("rufs mkfs called\n");
-	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(diskfile_path);
-	// write superblock information
-	const unsigned int inum_block_count = (MAX_INUM * sizeof(struct inode)) / BLOCK_SIZE; // num of blocks needed for inodes
+	// Step 1: Work out the layout
+	if(block_size != BLOCK_SIZE) {
+		fprintf(stderr,"rufs: block size %d, this build uses %d (-DBLOCK_SIZE)\n",block_size,BLOCK_SIZE);
+		return 1;
+	}
+	off_t max_dnum = size / BLOCK_SIZE;
+	off_t max_inum = inode_ratio > 0 ? size / inode_ratio : 0;
+	if(max_dnum < RUFS_MIN_BLOCKS || max_dnum > INT_MAX) {
+		fprintf(stderr,"rufs: size %lld out of range\n",(long long)size);
+		return 1;
+	}
+	if(max_inum < 16)
+		max_inum = 16;
+	if(max_inum > RUFS_MAX_INUM)
+		max_inum = RUFS_MAX_INUM;
+	if(blocks_per_group <= 0 || blocks_per_group > BITS_PER_BLOCK)
+		blocks_per_group = BITS_PER_BLOCK;
+	const int inodes_per_block = BLOCK_SIZE / sizeof(struct inode);
+	int ngroups, inodes_per_group, itable_blocks, ngdt;
+	for(;;) {
+		ngroups = (max_dnum + blocks_per_group - 1) / blocks_per_group;
+		// inodes are spread evenly over the groups, in whole inode table blocks
+		inodes_per_group = (max_inum + ngroups - 1) / ngroups;
+		inodes_per_group = (inodes_per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+		while(inodes_per_group > inodes_per_block && (off_t)inodes_per_group * ngroups > RUFS_MAX_INUM)
+			inodes_per_group -= inodes_per_block;
+		itable_blocks = inodes_per_group / inodes_per_block;
+		ngdt = (ngroups * sizeof(struct group_desc) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		// a last group too short for its metadata and some data is left off the disk
+		off_t last = max_dnum - (off_t)(ngroups - 1) * blocks_per_group;
+		if(ngroups > 1 && last < 2 + itable_blocks + RUFS_MIN_GROUP_DATA) {
+			max_dnum = (off_t)(ngroups - 1) * blocks_per_group;
+			continue;
+		}
+		break;
+	}
+	const off_t group0 = max_dnum < blocks_per_group ? max_dnum : blocks_per_group;
+	if(journal_blocks < 0) // the journal goes after group 0's inode table
+		journal_blocks = max_dnum / 16 < RUFS_MAX_JOURNAL ? max_dnum / 16 : RUFS_MAX_JOURNAL;
+	if(journal_blocks < RUFS_MIN_JOURNAL)
+		journal_blocks = 0;
+	if((off_t)inodes_per_group * ngroups > RUFS_MAX_INUM ||
+			1 + ngdt + 2 + itable_blocks + journal_blocks + RUFS_MIN_GROUP_DATA > group0) {
+		fprintf(stderr,"rufs: size %lld too small for %d groups of %d blocks\n",(long long)size,ngroups,blocks_per_group);
+		return 1;
+	}
 	struct superblock new_sb = { 
 		.magic_num = MAGIC_NUM, 
-		.max_inum = MAX_INUM,
-		.max_dnum = MAX_DNUM, // 3 represents the bitmaps and superblock stored before inodes
-		.i_bitmap_blk = 1, //0 is superblock, followed by inode bitmap
-		.d_bitmap_blk = 2, //then datablock bitmap
-		.i_start_blk = 3, //then the inodes themselves
-		.d_start_blk = inum_block_count + 3 //finally by the datablocks
+		.block_size = BLOCK_SIZE,
+		.max_inum = inodes_per_group * ngroups,
+		.max_dnum = max_dnum, // every block of the disk, metadata blocks are marked used
+		.blocks_per_group = blocks_per_group,
+		.inodes_per_group = inodes_per_group,
+		.groups = ngroups,
+		.gdt_blk = 1, //0 is superblock, followed by the group descriptors
+		.features = RUFS_DEFAULT_FEATURES | (journal_blocks ? RUFS_FEATURE_JOURNAL : 0),
+		.journal_blocks = journal_blocks
 	}; 
+	// Step 2: Call dev_init() to initialize (Create) Diskfile
+	int reused = access(diskfile_path,F_OK) == 0;
+	dev_init(diskfile_path,max_dnum * BLOCK_SIZE);
+	unsigned char block[BLOCK_SIZE]; // scratch block for bio_read/write
+	// write superblock information
 	// printf("creating superblock\n");
 	sb = new_sb;
-	memcpy(bmp,&sb,sizeof(struct superblock));
-	if(bio_write(0,bmp) <= 0)
+	// Step 3: Each group starts with its block bitmap, inode bitmap and inode table
+	if(groups_alloc())
+		return 1;
+	for(int g = 0; g < sb.groups; g++) {
+		struct group_desc *gd = &groups[g].gd;
+		gd->block_bitmap = group_start(g) + (g == 0 ? sb.gdt_blk + gdt_blocks() : 0);
+		gd->inode_bitmap = gd->block_bitmap + 1;
+		gd->inode_table = gd->inode_bitmap + 1;
+		if(g == 0)
+			sb.journal_blk = group_first_data(0);
+		const int used = group_first_data(g) - group_start(g) + (g == 0 ? sb.journal_blocks : 0);
+		for(int i = 0; i < used; i++)
+			set_bitmap(groups[g].bmap,i); //Mark these data blocks as reserved for filesystem metadata (superblock, descriptors, bitmaps, inodes)
+		gd->free_blocks = group_blocks(g) - used;
+		gd->free_inodes = sb.inodes_per_group;
+		group_mark_dirty(&groups[g].bmap_dirty);
+		group_mark_dirty(&groups[g].imap_dirty);
+	}
+	gdt_dirty = 1;
+	blkno_hint = 0;
+	memset(block,0,BLOCK_SIZE);
+	memcpy(block,&sb,sizeof(struct superblock));
+	if(bio_write(0,block) <= 0)
 		return 1;
 	// printf("superblock written\n");
-	// initialize inode bitmap
-	memset(bmp,0,BLOCK_SIZE);
-	if(bio_write(sb.i_bitmap_blk,bmp) <= 0)
+	if(bitmaps_flush())
+		return 1;
+	if(sb.journal_blocks && journal_format(sb.journal_blk,sb.journal_blocks))
 		return 1;
-	// printf("inode bitmap written\n");
-	// initialize data block bitmap
-	for(int i = 0; i < inum_block_count + sb.i_start_blk; i++)	
-		set_bitmap(bmp,i); //Mark these data blocks as reserved for filesystem metadata (superblock, bitmaps, inodes)
-	if(bio_write(sb.d_bitmap_blk,bmp) <= 0)
+	if(reused && itables_zero())
 		return 1;
-	// printf("datablock bitmap written\n");
+	// printf("bitmaps written\n");
+	bio_pin(0,group_first_data(0)); // keep superblock, descriptors and group 0 metadata in the block cache
 	// update inode for root directory
 	struct inode root = { 0 };
-	root.ino = get_avail_ino();
-	root.direct_ptr[0] = get_avail_blkno();
-	// printf("root.ino == %d, root.direct_ptr[0] == %d\n",root.ino,root.direct_ptr[0]);
-	if(root.ino == UINT16_MAX || root.direct_ptr[0] == -1)
-		return 1;
+	root.ino = get_avail_ino(-1,0); // inode 0 in group 0, counted as a directory below
+	groups[0].gd.used_dirs++;
 	root.type = S_IFDIR | 0755;
+	inode_init_map(&root);
+	int root_blk = get_avail_blkno(group_first_data(0));
+	// printf("root.ino == %d, root_blk == %d\n",root.ino,root_blk);
+	if(root.ino == UINT16_MAX || root_blk == -1 || bmap_set(&root,0,root_blk,1))
+		return 1;
 	root.vstat.st_mode = S_IFDIR | 0755;
 	root.vstat.st_mtime = time(NULL);
 	root.vstat.st_nlink = 2;
@@ -349,24 +2730,13 @@ int rufs_mkfs() {
 	root.vstat.st_gid = getgid();
 	root.valid = 1;
 	root.link = 2;
+	//. (same) and .. (parent) directory
+	dir_init_block(&root,block,root.ino);
 	int err = writei(root.ino,&root);
 	if(err)
 		return err;
 	// printf("inode root directory created\n");
-	memset(bmp,0,BLOCK_SIZE);
-	struct dirent *dirents = (struct dirent*)bmp;
-	//. (same) directory
-	dirents->ino = 0;
-	dirents->valid = 1;
-	strcpy(dirents->name,".");
-	dirents->len = 1;
-	//.. (parent) directory
-	(dirents+1)->ino = 0;
-	(dirents+1)->valid = 1;
-	strcpy((dirents+1)->name,"..");
-
-	(dirents+1)->len = 2;	
-	if(bio_write(root.direct_ptr[0],bmp) <= 0)
+	if(bio_write(root_blk,block) <= 0)
 		return 1;
 	// printf("inode root directory datablock created\n");
 	return 0;
@@ -378,57 +2748,196 @@ int rufs_mkfs() {
  */
 static void *rufs_init(struct fuse_conn_info *conn) {
 	// printf("rufs init called\n");
-	bmp = calloc(BLOCK_SIZE,1);
-	if(!bmp)
-		exit(EXIT_FAILURE);
-	ibmp = calloc(BLOCK_SIZE,1);
-	if(!ibmp)
-		exit(EXIT_FAILURE);
-	// printf("bitmaps allocated\n"); 
+	unsigned char block[BLOCK_SIZE]; // scratch block for bio_read/write
+	pthread_rwlockattr_t attr; // a waiting commit holds off new operations
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&journal_lock,&attr);
+	pthread_rwlockattr_destroy(&attr);
+	memset(ptr_cache,0,sizeof(ptr_cache));
+	icache_init();
+	dcache_init();
 	// Step 1a: If disk file is not found, call mkfs
-	if(dev_open(diskfile_path) != 0) {
+	if(rufs_opts.mkfs || dev_open(diskfile_path) != 0) {
 		// printf("disk file not found, creating\n");
-		int err = rufs_mkfs();
+		int err = rufs_mkfs(rufs_opts.size,rufs_opts.block_size,rufs_opts.inode_ratio,rufs_opts.group_blocks,
+				rufs_opts.journal_blocks);
 		// printf("disk file created!\n");
 		if(err)
 			exit(err); //error making file system, exit
 	} else { 
 		// printf("disk file found, reading\n");
 		// Step 1b: If disk file is found, just initialize in-memory data structures
-		if(bio_read(0,bmp) <= 0) // and read superblock from disk
+		if(bio_read(0,block) <= 0) // and read superblock from disk
 			exit(EXIT_FAILURE); // error reading, just EXIT
-		memcpy(&sb,bmp,sizeof(struct superblock));
+		memcpy(&sb,block,sizeof(struct superblock));
+		if(sb.magic_num != MAGIC_NUM || sb.block_size != BLOCK_SIZE) {
+			fprintf(stderr,"rufs: %s is not a rufs image with %d byte blocks\n",diskfile_path,BLOCK_SIZE);
+			exit(EXIT_FAILURE);
+		}
 		// printf("superblock read\n");
+		// then finish writing the last committed transaction
+		if((sb.features & RUFS_FEATURE_JOURNAL) &&
+				(journal_open(sb.journal_blk,sb.journal_blocks) || journal_replay() < 0)) {
+			fprintf(stderr,"rufs: journal replay failed\n");
+			exit(EXIT_FAILURE);
+		}
+		// and keep the descriptors and bitmaps of every group resident for allocation
+		struct group_desc *gdt = calloc(gdt_blocks(),BLOCK_SIZE);
+		if(!gdt || groups_alloc() || bio_read_range(sb.gdt_blk,gdt_blocks(),gdt) < 0)
+			exit(EXIT_FAILURE);
+		for(int g = 0; g < sb.groups; g++) { // both bitmaps of a group are adjacent, on disk and in bmap_mem
+			groups[g].gd = gdt[g];
+			if(bio_read_range(gdt[g].block_bitmap,2,groups[g].bmap) < 0)
+				exit(EXIT_FAILURE);
+		}
+		free(gdt);
+		bio_pin(0,group_first_data(0)); // keep superblock, descriptors and group 0 metadata in the block cache
+		blkno_hint = 0;
+	}
+	// Step 1c: Metadata stays in the block cache until the journal commits it
+	if(sb.features & RUFS_FEATURE_JOURNAL) {
+		journal_on = bio_hold(1,journal_capacity()) == 0;
+		if(!journal_on)
+			fprintf(stderr,"rufs: the device backend writes in place, journal not used\n");
 	}
+	// Step 2: One reader/writer lock per inode
+	inode_locks = malloc(sb.max_inum * sizeof(pthread_rwlock_t));
+	if(!inode_locks)
+		exit(EXIT_FAILURE);
+	for(int i = 0; i < sb.max_inum; i++)
+		pthread_rwlock_init(&inode_locks[i],NULL);
+	lazy_atime = calloc(sb.max_inum,sizeof(time_t));
+	wbufs = calloc(sb.max_inum,sizeof(struct wbuf));
+	if(!lazy_atime || !wbufs)
+		exit(EXIT_FAILURE);
+	// Step 3: Write back dirty metadata periodically and start prefetching for readers
+	commit_start();
+	ra_start();
 	return NULL;
 }
 
 static void rufs_destroy(void *userdata) {
 	// printf("rufs destroy called\n");
-	// Step 1: De-allocate in-memory data structures
-	free(bmp);
-	free(ibmp);
-	// Step 2: Close diskfile
+	// Step 1: Write back the access times and bitmaps and de-allocate in-memory data structures
+	commit_stop();
+	ra_stop();
+	rufs_sync_all();
+	bio_hold(0,0);
+	journal_on = 0;
+	pthread_rwlock_destroy(&journal_lock);
+	free(lazy_atime);
+	lazy_atime = NULL;
+	for(int i = 0; i < sb.max_inum; i++)
+		wbuf_drop(&wbufs[i]);
+	free(wbufs);
+	wbufs = NULL;
+	for(int i = 0; i < sb.max_inum; i++)
+		pthread_rwlock_destroy(&inode_locks[i]);
+	free(inode_locks);
+	groups_free();
+	// Step 2: Close diskfile (writes back the block cache)
 	// printf("closing diskfile\n");
 	dev_close();
 	// printf("diskfile closed\n");
 }
 
+/*
+ * Statistics file
+ * /.rufs_stats is read-only and not listed in the root directory. Opening it takes a snapshot
+ * of stats_report() that is kept in the open_files slot of the handle. The name is reserved,
+ * it cannot be created or removed.
+ */
+#define STATS_FILE "/.rufs_stats"
+
+struct stats_snapshot {
+	int len;
+	char data[];
+};
+
+// Returns the snapshot of a statistics file handle, or NULL for any other handle
+static struct stats_snapshot *stats_handle(struct fuse_file_info *fi) {
+	if(!fi || fi->fh >= MAX_OPEN_FILES)
+		return NULL;
+	pthread_mutex_lock(&open_files_lock);
+	struct stats_snapshot *snap = open_files[fi->fh].used ? open_files[fi->fh].stats : NULL;
+	pthread_mutex_unlock(&open_files_lock);
+	return snap;
+}
+
+static void stats_file_stat(struct stat *stbuf) {
+	memset(stbuf,0,sizeof(*stbuf));
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+}
+
+static int stats_file_open(struct fuse_file_info *fi) {
+	if((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+	// the report can grow while it is being written, retry with the larger size
+	int size = 4096;
+	struct stats_snapshot *snap = NULL;
+	while(1) {
+		struct stats_snapshot *p = realloc(snap,sizeof(*snap) + size);
+		if(!p) {
+			free(snap);
+			return -ENOMEM;
+		}
+		snap = p;
+		snap->len = stats_report(snap->data,size);
+		if(snap->len < size)
+			break;
+		size = snap->len + 1024;
+	}
+	fi->direct_io = 1; // st_size is 0, read until the end of the snapshot
+	int res = ofile_store(0,NULL,snap,fi);
+	if(res)
+		free(snap);
+	return res;
+}
+
+static int stats_file_read(struct stats_snapshot *snap, char *buffer, size_t size, off_t offset) {
+	if(offset >= snap->len)
+		return 0;
+	if(size > snap->len - offset)
+		size = snap->len - offset;
+	memcpy(buffer,snap->data + offset,size);
+	return size;
+}
+
 static int rufs_getattr(const char *path, struct stat *stbuf) {
 	// printf("rufs getattr called on %s\n",path);
+	if(!strcmp(path,STATS_FILE)) {
+		stats_file_stat(stbuf);
+		return 0;
+	}
 	// Step 1: call get_node_by_path() to get inode from path
 	struct inode inode;
-	int res = get_node_by_path(path,0,&inode);
+	int res = get_locked_node(path,0,&inode);
 	if(res)
 		return res;
 	// Step 2: fill attribute of file into stbuf from inode
 	// printf("success, storing stat\n");
-	inode.vstat.st_atime = time(NULL);
-	inode.vstat.st_mtime = inode.vstat.st_atime;
 	*stbuf = inode.vstat;
-	// printf("updating inode\n");
-	writei(inode.ino,&inode);
-	// printf("inode updated\n");
+	inode_unlock(inode.ino);
+	return 0;
+}
+
+static int rufs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+	// Same as getattr, but through the open handle
+	struct inode inode;
+	if(stats_handle(fi)) {
+		stats_file_stat(stbuf);
+		return 0;
+	}
+	int res = get_locked_file(path,fi,0,&inode);
+	if(res)
+		return res;
+	*stbuf = inode.vstat;
+	inode_unlock(inode.ino);
 	return 0;
 }
 
@@ -436,56 +2945,64 @@ static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
 	// printf("rufs opendir called on %s\n",path);
 	// Step 1: Call get_node_by_path() to get inode from path
 	struct inode inode;
-	int res = get_node_by_path(path,0,&inode);
-	if(res || !S_ISDIR(inode.vstat.st_mode))
+	int res = get_locked_node(path,0,&inode);
+	if(res)
 		return -1;
+	inode_unlock(inode.ino);
 	// Step 2: If not find, return -1
-	// printf("got inode, writing updated access\n");
-	inode.vstat.st_mtime = time(NULL);
-	inode.vstat.st_atime = inode.vstat.st_mtime;
-	if(writei(inode.ino,&inode))
+	if(!S_ISDIR(inode.vstat.st_mode))
 		return -1;
-	fi->fh = inode.ino;
+	// Step 3: Later calls on this handle find the inode through fi->fh
 	// printf("returning ino\n");
-    return 0;
+	return ofile_open(inode.ino,fi);
+}
+
+struct readdir_ctx {
+	void *buffer;
+	fuse_fill_dir_t filler;
+};
+
+// dir_walk callback, copies the entries of one directory block to filler
+static int readdir_block(unsigned char *block, int packed, void *arg) {
+	struct readdir_ctx *ctx = arg;
+	struct dirent dir_entry;
+	int pos = 0;
+	// iterate through directory entries in the data block
+	while (dblk_next(block,packed,&pos,&dir_entry) >= 0) {
+		struct inode dir_entry_inode;
+		if(readi(dir_entry.ino,&dir_entry_inode))
+			return -1;
+		// printf("adding directory entry\n");
+		ctx->filler(ctx->buffer,dir_entry.name,&dir_entry_inode.vstat,0);
+	}
+	return 0;
 }
 
 static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
 	// printf("rufs readdir called on %s\n",path);
 	// Step 1: Call get_node_by_path() to get inode from path
 	struct inode dir_inode;
-	int res = get_node_by_path(path,0,&dir_inode);
-	if(res || !S_ISDIR(dir_inode.vstat.st_mode))
+	struct readdir_ctx ctx = { buffer, filler };
+	int res = get_locked_file(path,fi,0,&dir_inode);
+	if(res)
 		return -1;
+	if(!S_ISDIR(dir_inode.vstat.st_mode))
+		res = -1;
 	// printf("got path\n");
-	for (int i = 0; i < 16; i++) {
-		int data_block_idx = dir_inode.direct_ptr[i];
-		if (data_block_idx == 0)
-			continue; //empty direct_ptr, do not search
-		// Step 2: Read directory entries from its data blocks, and copy them to filler
-		if (bio_read(data_block_idx, bmp) <= 0)
-			return -1; // error: failed to read directory data block
-
-		// iterate through directory entries in the data block
-		int offset = 0;
-		while (offset + sizeof(struct dirent) < BLOCK_SIZE) {
-			struct dirent *dir_entry = (struct dirent *)(bmp + offset);
-			struct inode dir_entry_inode;
-			if (dir_entry->valid) {
-				if(readi(dir_entry->ino,&dir_entry_inode))
-					return -1;
-				// printf("adding directory entry\n");
-				filler(buffer,dir_entry->name,&dir_entry_inode.vstat,0);
-			}
-			offset += sizeof(struct dirent);
-		}
-	}
-	return 0;
+	// Step 2: Read directory entries from its data blocks, and copy them to filler
+	if(!res && dir_walk(&dir_inode,readdir_block,&ctx))
+		res = -1;
+	if(!res)
+		inode_touch_atime(&dir_inode);
+	inode_unlock(dir_inode.ino);
+	return res;
 }
 
 
 static int rufs_mkdir(const char *path, mode_t mode) {
 	// printf("rufs mkdir called on %s\n",path);
+	if(!strcmp(path,STATS_FILE))
+		return -EEXIST;
 	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
 	char *path_copy = malloc(strlen(path) + 1);
 	char *path_copy2 = malloc(strlen(path) + 1);
@@ -495,40 +3012,41 @@ static int rufs_mkdir(const char *path, mode_t mode) {
 	char *directory_name = basename(path_copy2);
 	// Step 2: Call get_node_by_path() to get inode of parent directory
 	struct inode parent_inode;
+	unsigned char block[BLOCK_SIZE]; // scratch block for bio_read/write
+	int new_ino = -1, new_blk = -1;
+	handle_start();
+	pthread_rwlock_wrlock(&namespace_lock);
 	int res = get_node_by_path(parent_path,0,&parent_inode);
-	if(res || !S_ISDIR(parent_inode.vstat.st_mode))
-		return -1;
+	if(res || !S_ISDIR(parent_inode.vstat.st_mode)) {
+		res = -1;
+		goto out;
+	}
+	inode_lock(parent_inode.ino,1);
+	if(readi(parent_inode.ino,&parent_inode)) {
+		res = -1;
+		goto out_unlock;
+	}
 	// printf("got path\n");	
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int new_ino = get_avail_ino();
-	if(new_ino == -1)
-		return -1;
+	// Step 3: Call get_avail_ino() to get an available inode number, in a lightly used group
+	new_ino = get_avail_ino(parent_inode.ino,1);
+	if(new_ino == -1) {
+		res = -1;
+		goto out_unlock;
+	}
 	// printf("got ino\n");
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	if(dir_add(parent_inode,new_ino,directory_name,strlen(directory_name)))
-		return -1;
-	// printf("dir added\n");
-	// Step 5: Update inode for target directory
+	// Step 4: Update inode for target directory, it is written before it becomes reachable
 	struct inode new_dir_inode = { 0 };
-	new_dir_inode.direct_ptr[0] = get_avail_blkno();
-	memset(bmp,0,BLOCK_SIZE);
-	struct dirent *dirents = (struct dirent*)bmp;
+	new_dir_inode.type = S_IFDIR | mode;
+	inode_init_map(&new_dir_inode);
+	new_blk = get_avail_blkno(group_goal(new_ino));
+	if(new_blk < 0 || bmap_set(&new_dir_inode,0,new_blk,1)) {
+		res = -1;
+		goto out_unlock;
+	}
 	// printf("blkno got\n");
-	//. (same) directory
-	dirents->ino = new_ino;
-	dirents->valid = 1;
-	strcpy(dirents->name,".");
-	dirents->len = 1;
-	//.. (parent) directory
-	(dirents+1)->ino = parent_inode.ino;
-	(dirents+1)->valid = 1;
-	strcpy((dirents+1)->name,"..");
-	(dirents+1)->len = 2;	
-	if(bio_write(new_dir_inode.direct_ptr[0],bmp) <= 0) //write directory entries to datablock
-		return -1;
-	// printf(". & .. added\n");
 	new_dir_inode.ino = new_ino;
-	new_dir_inode.type = S_IFDIR | mode;
+	//. (same) and .. (parent) directory
+	dir_init_block(&new_dir_inode,block,parent_inode.ino);
 	new_dir_inode.vstat.st_mode = S_IFDIR | mode;
 	new_dir_inode.vstat.st_mtime = time(NULL);
 	new_dir_inode.size = BLOCK_SIZE;
@@ -538,41 +3056,136 @@ static int rufs_mkdir(const char *path, mode_t mode) {
 	new_dir_inode.vstat.st_nlink = new_dir_inode.link;
 	new_dir_inode.vstat.st_uid = getuid();
 	new_dir_inode.vstat.st_gid = getgid();
-	// Step 6: Call writei() to write inode to disk
+	// Step 5: Call writei() to write inode to disk
+	if(bio_write(new_blk,block) <= 0 || writei(new_ino,&new_dir_inode)) { //write directory entries to datablock
+		res = -1;
+		goto out_unlock;
+	}
+	// printf(". & .. added\n");
+	// Step 6: Call dir_add() to add directory entry of target directory to parent directory
+	if(dir_add(parent_inode,new_ino,directory_name,strlen(directory_name)))
+		res = -1;
+	// printf("dir added\n");
+out_unlock:
+	inode_unlock(parent_inode.ino);
+out:
+	pthread_rwlock_unlock(&namespace_lock);
+	if(res) { // give back what was allocated
+		if(new_blk >= 0)
+			release_blkno(new_blk);
+		if(new_ino >= 0)
+			release_ino(new_ino,1);
+	}
+	handle_stop();
 	free(path_copy2);
 	free(path_copy);
-	if(writei(new_ino,&new_dir_inode))
-		return -1;
-	// printf("writei written %d\n",new_ino);
+	return res;
+}
+
+// dir_walk callback, fails with -ENOTEMPTY on any entry besides . and ..
+static int dir_empty_block(unsigned char *block, int packed, void *arg) {
+	struct dirent dir_entry;
+	int pos = 0;
+	while (dblk_next(block,packed,&pos,&dir_entry) >= 0)
+		if (!(dir_entry.len == 1 && dir_entry.name[0] == '.') &&
+				!(dir_entry.len == 2 && dir_entry.name[0] == '.' && dir_entry.name[1] == '.'))
+			return -ENOTEMPTY;
 	return 0;
 }
 
+/*
+ * Remove the entry of path from its parent and free the inode once its last link is gone,
+ * shared by unlink and rmdir
+ * Open inodes are refused with -EBUSY: there are no orphan inodes kept alive until their
+ * last release, and without a rename operation FUSE cannot hide such a file either, so
+ * unlinking a file that is still open fails instead of freeing the inode under its users
+ */
+static int remove_node(const char *path, int is_dir) {
+	if(!strcmp(path,STATS_FILE))
+		return -EACCES;
+	// Step 1: Use dirname() and basename() to separate parent directory path and target name
+	char *path_copy = malloc(strlen(path) + 1);
+	char *path_copy2 = malloc(strlen(path) + 1);
+	strcpy(path_copy,path);
+	strcpy(path_copy2,path);
+	char *parent_path = dirname(path_copy);
+	char *name = basename(path_copy2);
+	const size_t len = strlen(name);
+	struct inode parent_inode, inode;
+	handle_start();
+	pthread_rwlock_wrlock(&namespace_lock);
+	// Step 2: Call get_node_by_path() to get the inodes of the parent directory and the target
+	int res = get_node_by_path(parent_path,0,&parent_inode);
+	if(!res && !S_ISDIR(parent_inode.vstat.st_mode))
+		res = -ENOTDIR;
+	if(!res && (!strcmp(name,"/") || !strcmp(name,".") || !strcmp(name,"..")))
+		res = is_dir ? -EBUSY : -EISDIR;
+	if(!res)
+		res = get_node_by_path(name,parent_inode.ino,&inode);
+	if(!res && S_ISDIR(inode.vstat.st_mode) != is_dir)
+		res = is_dir ? -ENOTDIR : -EISDIR;
+	if(!res && ofile_busy(inode.ino))
+		res = -EBUSY;
+	if(res)
+		goto out;
+	inode_lock(parent_inode.ino,1);
+	inode_lock(inode.ino,1);
+	if(readi(parent_inode.ino,&parent_inode) || readi(inode.ino,&inode)) {
+		res = -EIO;
+		goto out_unlock;
+	}
+	// Step 3: A directory has to be empty
+	if(is_dir && (res = dir_walk(&inode,dir_empty_block,NULL)))
+		goto out_unlock;
+	// Step 4: Call dir_remove() to remove the entry from the parent directory
+	if((res = dir_remove(parent_inode,name,len)))
+		goto out_unlock;
+	// Step 5: The last link clears the data block bitmap and the inode bitmap of the target
+	inode.link = is_dir ? 0 : inode.link - 1;
+	inode.vstat.st_nlink = inode.link;
+	if(inode.link == 0) {
+		wbuf_drop(&wbufs[inode.ino]);
+		__atomic_store_n(&lazy_atime[inode.ino],0,__ATOMIC_RELAXED);
+		res = bmap_free(&inode);
+		inode.valid = 0;
+		inode.size = 0;
+		inode.vstat.st_size = 0;
+	}
+	if(writei(inode.ino,&inode))
+		res = -EIO;
+	if(inode.link == 0) {
+		release_ino(inode.ino,is_dir);
+		if(is_dir) { // its . and .. entries are cached under its own number
+			dcache_invalidate(inode.ino,".",1);
+			dcache_invalidate(inode.ino,"..",2);
+		}
+	}
+out_unlock:
+	inode_unlock(inode.ino);
+	inode_unlock(parent_inode.ino);
+out:
+	pthread_rwlock_unlock(&namespace_lock);
+	handle_stop();
+	free(path_copy2);
+	free(path_copy);
+	return res;
+}
+
 // Required for 518
 static int rufs_rmdir(const char *path) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-
-	// Step 2: Call get_node_by_path() to get inode of target directory
-
-	// Step 3: Clear data block bitmap of target directory
-
-	// Step 4: Clear inode bitmap and its data block
-
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-
-	return 0;
+	return remove_node(path,1);
 }
 
 static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
-// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	// Drop the handle opendir made
+	ofile_close(fi);
+	return 0;
 }
 
 static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 	// printf("rufs create called\n");
+	if(!strcmp(path,STATS_FILE))
+		return -EEXIST;
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
 	char *path_copy = malloc(strlen(path) + 1);
 	char *path_copy2 = malloc(strlen(path) + 1);
@@ -582,17 +3195,30 @@ static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	char *directory_name = basename(path_copy2);
 	// Step 2: Call get_node_by_path() to get inode of parent directory
 	struct inode parent_inode;
+	int new_ino = -1;
+	handle_start();
+	pthread_rwlock_wrlock(&namespace_lock);
 	int res = get_node_by_path(parent_path,0,&parent_inode);
-	if(res || !S_ISDIR(parent_inode.vstat.st_mode))
-		return -1;
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int new_ino = get_avail_ino();
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	dir_add(parent_inode,new_ino,directory_name,strlen(directory_name));
-	// Step 5: Update inode for target file
+	if(res || !S_ISDIR(parent_inode.vstat.st_mode)) {
+		res = -1;
+		goto out;
+	}
+	inode_lock(parent_inode.ino,1);
+	if(readi(parent_inode.ino,&parent_inode)) {
+		res = -1;
+		goto out_unlock;
+	}
+	// Step 3: Call get_avail_ino() to get an available inode number, near the parent
+	new_ino = get_avail_ino(parent_inode.ino,0);
+	if(new_ino == -1) {
+		res = -1;
+		goto out_unlock;
+	}
+	// Step 4: Update inode for target file, it is written before it becomes reachable
 	struct inode new_file_inode = { 0 };
 	new_file_inode.ino = new_ino;
 	new_file_inode.type = S_IFREG | mode;
+	inode_init_map(&new_file_inode);
 	new_file_inode.vstat.st_mode = S_IFREG | mode;
 	new_file_inode.vstat.st_mtime = time(NULL);
 	new_file_inode.vstat.st_size = 0;
@@ -603,120 +3229,212 @@ static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	new_file_inode.vstat.st_nlink = new_file_inode.link;
 	new_file_inode.vstat.st_uid = getuid();
 	new_file_inode.vstat.st_gid = getgid();
-	// Step 6: Call writei() to write inode to disk
+	// Step 5: Call writei() to write inode to disk and open a handle on it
+	if(writei(new_ino,&new_file_inode) || ofile_open(new_ino,fi)) {
+		res = -1;
+		goto out_unlock;
+	}
+	// Step 6: Call dir_add() to add directory entry of target file to parent directory
+	if(dir_add(parent_inode,new_ino,directory_name,strlen(directory_name))) {
+		ofile_close(fi);
+		res = -1;
+	}
+out_unlock:
+	inode_unlock(parent_inode.ino);
+out:
+	pthread_rwlock_unlock(&namespace_lock);
+	if(res && new_ino >= 0)
+		release_ino(new_ino,0);
+	handle_stop();
 	free(path_copy2);
 	free(path_copy);
-	return writei(new_ino,&new_file_inode) == 0 ? 0 : -1;
+	return res;
 }
 
 static int rufs_open(const char *path, struct fuse_file_info *fi) {
 	// printf("rufs opendir called\n");
+	if(!strcmp(path,STATS_FILE))
+		return stats_file_open(fi);
 	// Step 1: Call get_node_by_path() to get inode from path
 	struct inode inode;
-	int res = get_node_by_path(path,0,&inode);
-	if(res || !S_ISREG(inode.vstat.st_mode))
+	int res = get_locked_node(path,0,&inode);
+	if(res)
 		return -1;
+	inode_unlock(inode.ino);
 	// Step 2: If not find, return -1
-	// printf("got inode, writing updated access\n");
-	inode.vstat.st_mtime = time(NULL);
-	inode.vstat.st_atime = inode.vstat.st_mtime;
-	if(writei(inode.ino,&inode))
+	if(!S_ISREG(inode.vstat.st_mode))
 		return -1;
-	fi->fh = inode.ino;
+	// Step 3: Later calls on this handle find the inode through fi->fh
 	// printf("returning ino\n");
-    return 0;
+	return ofile_open(inode.ino,fi);
 }
 
-static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// printf("rufs read called\n");
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode inode;
-	int res = get_node_by_path(path,0,&inode);
-	if(res || !S_ISREG(inode.vstat.st_mode))
-		return -1;
+/*
+ * Copy up to size bytes at offset of a file into buffer, the caller holds the inode lock
+ */
+static int read_data(struct inode *inode, char *buffer, size_t size, off_t offset) {
+	if(offset >= inode->size)
+		return 0;
+	if(offset + size > inode->size)
+		size = inode->size - offset;
 	// Step 2: Based on size and offset, read its data blocks from disk
 	// printf("path got called\n");
-	int total_read = 0;
-	int d_ptr = offset / BLOCK_SIZE;
-	offset = offset % BLOCK_SIZE;
-	for(; d_ptr < 16; d_ptr++) {
+	unsigned char block[BLOCK_SIZE]; // partial head and tail blocks
+	size_t total_read = 0;
+	uint32_t lblk = offset / BLOCK_SIZE;
+	int block_offset = offset % BLOCK_SIZE;
+	while(total_read < size) {
+		uint32_t run;
+		int pblk = bmap(inode,lblk,&run);
+		if(pblk < 0)
+			return -EIO;
 		// Step 3: copy the correct amount of data from offset to buffer
-		if(inode.direct_ptr[d_ptr] == 0)
-			break;
-		if(bio_read(inode.direct_ptr[d_ptr],bmp) <= 0)
-			return -1;
-		int amount_to_read = ((size < BLOCK_SIZE) ? size : BLOCK_SIZE) - offset;
-		memcpy(buffer + total_read,bmp + offset,amount_to_read);
-		offset = 0;
-		size -= amount_to_read;
+		if(block_offset == 0 && size - total_read >= BLOCK_SIZE) {
+			// whole blocks of this run go straight into the caller's buffer
+			uint32_t n = (size - total_read) / BLOCK_SIZE;
+			if(n > run)
+				n = run;
+			if(pblk == 0) // hole, reads as zeros
+				memset(buffer + total_read,0,(size_t)n * BLOCK_SIZE);
+			else if(bio_read_range(pblk,n,buffer + total_read) < 0)
+				return -EIO;
+			total_read += (size_t)n * BLOCK_SIZE;
+			lblk += n;
+			continue;
+		}
+		int amount_to_read = BLOCK_SIZE - block_offset;
+		if(amount_to_read > size - total_read)
+			amount_to_read = size - total_read;
+		if(pblk == 0)
+			memset(block,0,BLOCK_SIZE);
+		else if(bio_read(pblk,block) <= 0)
+			return -EIO;
+		memcpy(buffer + total_read,block + block_offset,amount_to_read);
+		block_offset = 0;
 		total_read += amount_to_read;
+		lblk++;
 	}
-	// printf("read success\n");
+	// Step 4: Data still in the write buffer is newer than the disk
+	wbuf_overlay(&wbufs[inode->ino],buffer,total_read,offset);
 	// Note: this function should return the amount of bytes you copied to buffer
 	return total_read;
 }
 
-static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// printf("rufs write called\n");
+static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	// printf("rufs read called\n");
 	// Step 1: You could call get_node_by_path() to get inode from path
 	struct inode inode;
-	int res = get_node_by_path(path,0,&inode);
-	if(res || !S_ISREG(inode.vstat.st_mode))
+	if(stats_handle(fi))
+		return stats_file_read(stats_handle(fi),buffer,size,offset);
+	int res = get_locked_file(path,fi,0,&inode);
+	if(res)
 		return -1;
 	// Step 2: Based on size and offset, read its data blocks from disk
-	// printf("path got called\n");
-	int total_written = 0;
-	int d_ptr = offset / BLOCK_SIZE;
-	offset = offset % BLOCK_SIZE;
-	while(size > 0) {
-		// Step 2: Based on size and offset, read its data blocks from disk
-		if(inode.direct_ptr[d_ptr] == 0) { // none left to write
-			inode.direct_ptr[d_ptr] = get_avail_blkno();
-			if(inode.direct_ptr[d_ptr] < -1)
-				return -1;
-			memset(bmp,0,BLOCK_SIZE);
-		} else 
-			if(bio_read(inode.direct_ptr[d_ptr],bmp) <= 0)
-				return -1;
-		int amount_to_write = ((size < BLOCK_SIZE) ? size : BLOCK_SIZE) - offset;
-		// Step 3: Write the correct amount of data from offset to disk
-		memcpy(bmp + offset,buffer + total_written,amount_to_write);
-		offset = 0;
-		size -= amount_to_write;
+	if(!S_ISREG(inode.vstat.st_mode))
+		res = -1;
+	else
+		res = read_data(&inode,buffer,size,offset);
+	if(res >= 0) {
+		inode_touch_atime(&inode);
+		ofile_readahead(fi,&inode,offset,res);
+	}
+	inode_unlock(inode.ino);
+	// printf("read success\n");
+	return res;
+}
+
+/*
+ * Write size bytes of buffer at offset of a file and update its inode, the caller holds the inode lock
+ */
+static int write_data(struct inode *inode, const char *buffer, size_t size, off_t offset) {
+	struct wbuf *wb = &wbufs[inode->ino];
+	unsigned char block[BLOCK_SIZE]; // old contents of a partially written block
+	size_t total_written = 0;
+	uint32_t lblk = offset / BLOCK_SIZE;
+	int block_offset = offset % BLOCK_SIZE;
+	int res = 0;
+	// Step 2: Copy the data into the inode's write buffer, blocks are allocated when it is flushed
+	while(total_written < size) {
+		int amount_to_write = BLOCK_SIZE - block_offset;
+		if(amount_to_write > size - total_written)
+			amount_to_write = size - total_written;
+		int created;
+		unsigned char *page = wbuf_find(wb,lblk);
+		if(!page) {
+			// a partial block starts out as the block on disk, holes and new blocks as zeros,
+			// whole blocks skip the read
+			uint32_t run;
+			int pblk = (off_t)lblk * BLOCK_SIZE < inode->size ? bmap(inode,lblk,&run) : 0;
+			if(pblk < 0 || (pblk > 0 && amount_to_write < BLOCK_SIZE && bio_read(pblk,block) <= 0)) {
+				res = -EIO;
+				break;
+			}
+			if(pblk == 0 && wbuf_reserve(1)) {
+				res = -ENOSPC;
+				break;
+			}
+			if(!(page = wbuf_get(wb,lblk,&created))) {
+				if(pblk == 0)
+					__atomic_sub_fetch(&wbuf_reserved,1,__ATOMIC_RELAXED);
+				res = -ENOMEM;
+				break;
+			}
+			if(pblk == 0)
+				wb->reserved++;
+			if(amount_to_write < BLOCK_SIZE) {
+				if(pblk == 0)
+					memset(page,0,BLOCK_SIZE);
+				else
+					memcpy(page,block,BLOCK_SIZE);
+			}
+		}
+		memcpy(page + block_offset,buffer + total_written,amount_to_write);
+		block_offset = 0;
 		total_written += amount_to_write;
-		if(bio_write(inode.direct_ptr[d_ptr],bmp) <= 0)
-			return -1;
-		if(amount_to_write != 0)
-			d_ptr++;
+		lblk++;
 	}
-	// Step 4: Update the inode info and write it to disk
+	if(total_written == 0)
+		return res;
+	// Step 3: Update the inode info, writei only touches the inode cache
 	// printf("updating inode\n");
-	inode.size += total_written;
-	inode.vstat.st_size = inode.size;
-	inode.vstat.st_mtime = time(NULL);
-	if(writei(inode.ino,&inode))
-		return -1;
+	if(offset + total_written > inode->size)
+		inode->size = offset + total_written;
+	inode->vstat.st_size = inode->size;
+	inode->vstat.st_mtime = time(NULL);
+	if(writei(inode->ino,inode))
+		return -EIO;
+	// Step 4: Write the buffer out early when it holds too much memory, handle_stop
+	// writes back all buffers once together they hold too much
+	if(wb->count >= WBUF_INODE_PAGES)
+		if((res = wbuf_flush(inode)))
+			return res;
 	// printf("write success\n");
 	return total_written;
 }
 
-// Required for 518
+static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	// printf("rufs write called\n");
+	// Step 1: You could call get_node_by_path() to get inode from path
+	struct inode inode;
+	handle_start();
+	int res = get_locked_file(path,fi,1,&inode);
+	if(res) {
+		handle_stop();
+		return -1;
+	}
+	if(!S_ISREG(inode.vstat.st_mode))
+		res = -1;
+	else
+		res = write_data(&inode,buffer,size,offset);
+	inode_unlock(inode.ino);
+	handle_stop();
+	// printf("write success\n");
+	return res;
+}
 
+// Required for 518, a file that is still open is refused with -EBUSY (see remove_node)
 static int rufs_unlink(const char *path) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-
-	// Step 2: Call get_node_by_path() to get inode of target file
-
-	// Step 3: Clear data block bitmap of target file
-
-	// Step 4: Clear inode bitmap and its data block
-
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
-
-	return 0;
+	return remove_node(path,0);
 }
 
 static int rufs_truncate(const char *path, off_t size) {
@@ -725,16 +3443,51 @@ static int rufs_truncate(const char *path, off_t size) {
     return 0;
 }
 
+// Write out the buffered data of one file
+static int rufs_flush_file(const char *path, struct fuse_file_info *fi) {
+	struct inode inode;
+	handle_start();
+	int res = get_locked_file(path,fi,1,&inode);
+	if(!res) {
+		res = wbuf_flush(&inode);
+		inode_unlock(inode.ino);
+	}
+	handle_stop();
+	return res;
+}
+
 static int rufs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+	// Write out the buffered data and drop the handle open or create made
+	if(stats_handle(fi)) {
+		ofile_close(fi);
+		return 0;
+	}
+	int res = rufs_flush_file(path,fi);
+	ofile_close(fi);
+	return res;
 }
 
 static int rufs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	// Write back the file's buffered data, the inodes, the bitmaps and the dirty blocks held in the block cache
+	// With the journal the metadata waits for the next commit
+	if(stats_handle(fi))
+		return 0;
+	int res = rufs_flush_file(path,fi);
+	if(res || journal_on)
+		return res;
+	if(icache_flush() || bitmaps_flush())
+		return -EIO;
+	return bio_flush() == 0 ? 0 : -EIO;
+}
+
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	// Write back access times, inodes, bitmaps and the block cache and force them to stable storage
+	// With the journal the commit already wrote the blocks in place, anything dirtied since
+	// belongs to operations of the next transaction
+	int res = rufs_sync_all();
+	if(journal_on ? dev_barrier() : dev_sync())
+		res = -EIO;
+	return res;
 }
 
 static int rufs_utimens(const char *path, const struct timespec tv[2]) {
@@ -743,38 +3496,173 @@ static int rufs_utimens(const char *path, const struct timespec tv[2]) {
     return 0;
 }
 
+/*
+ * Every callback is counted and timed in the statistics through a stats_ wrapper
+ */
+#define STATS_WRAP(op, fn, params, args) \
+	static int stats_##fn params { \
+		uint64_t start = stats_now(); \
+		int res = fn args; \
+		stats_op(op,res,start); \
+		return res; \
+	}
+
+STATS_WRAP(ST_GETATTR, rufs_getattr, (const char *path, struct stat *stbuf), (path,stbuf))
+STATS_WRAP(ST_FGETATTR, rufs_fgetattr, (const char *path, struct stat *stbuf, struct fuse_file_info *fi), (path,stbuf,fi))
+STATS_WRAP(ST_OPENDIR, rufs_opendir, (const char *path, struct fuse_file_info *fi), (path,fi))
+STATS_WRAP(ST_READDIR, rufs_readdir, (const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi),
+	(path,buffer,filler,offset,fi))
+STATS_WRAP(ST_RELEASEDIR, rufs_releasedir, (const char *path, struct fuse_file_info *fi), (path,fi))
+STATS_WRAP(ST_MKDIR, rufs_mkdir, (const char *path, mode_t mode), (path,mode))
+STATS_WRAP(ST_RMDIR, rufs_rmdir, (const char *path), (path))
+STATS_WRAP(ST_CREATE, rufs_create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path,mode,fi))
+STATS_WRAP(ST_OPEN, rufs_open, (const char *path, struct fuse_file_info *fi), (path,fi))
+STATS_WRAP(ST_READ, rufs_read, (const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi),
+	(path,buffer,size,offset,fi))
+STATS_WRAP(ST_WRITE, rufs_write, (const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi),
+	(path,buffer,size,offset,fi))
+STATS_WRAP(ST_UNLINK, rufs_unlink, (const char *path), (path))
+STATS_WRAP(ST_TRUNCATE, rufs_truncate, (const char *path, off_t size), (path,size))
+STATS_WRAP(ST_FLUSH, rufs_flush, (const char *path, struct fuse_file_info *fi), (path,fi))
+STATS_WRAP(ST_FSYNC, rufs_fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path,datasync,fi))
+STATS_WRAP(ST_UTIMENS, rufs_utimens, (const char *path, const struct timespec tv[2]), (path,tv))
+STATS_WRAP(ST_RELEASE, rufs_release, (const char *path, struct fuse_file_info *fi), (path,fi))
 
 static struct fuse_operations rufs_ope = {
 	.init		= rufs_init,
 	.destroy	= rufs_destroy,
 
-	.getattr	= rufs_getattr,
-	.readdir	= rufs_readdir,
-	.opendir	= rufs_opendir,
-	.releasedir	= rufs_releasedir,
-	.mkdir		= rufs_mkdir,
-	.rmdir		= rufs_rmdir,
-
-	.create		= rufs_create,
-	.open		= rufs_open,
-	.read 		= rufs_read,
-	.write		= rufs_write,
-	.unlink		= rufs_unlink,
-
-	.truncate   = rufs_truncate,
-	.flush      = rufs_flush,
-	.utimens    = rufs_utimens,
-	.release	= rufs_release
+	.getattr	= stats_rufs_getattr,
+	.fgetattr	= stats_rufs_fgetattr,
+	.readdir	= stats_rufs_readdir,
+	.opendir	= stats_rufs_opendir,
+	.releasedir	= stats_rufs_releasedir,
+	.mkdir		= stats_rufs_mkdir,
+	.rmdir		= stats_rufs_rmdir,
+
+	.create		= stats_rufs_create,
+	.open		= stats_rufs_open,
+	.read 		= stats_rufs_read,
+	.write		= stats_rufs_write,
+	.unlink		= stats_rufs_unlink,
+
+	.truncate   = stats_rufs_truncate,
+	.flush      = stats_rufs_flush,
+	.fsync      = stats_rufs_fsync,
+	.utimens    = stats_rufs_utimens,
+	.release	= stats_rufs_release,
+
+	// read, write, readdir and release work from fi->fh alone
+	.flag_nullpath_ok = 1,
+	.flag_nopath = 1
+};
+
+
+#ifndef RUFS_NO_MAIN	// microbench.c includes this file and drives rufs_ope itself
+
+enum { KEY_NOATIME, KEY_RELATIME, KEY_STRICTATIME, KEY_COMMIT, KEY_READAHEAD, KEY_SYNC_READAHEAD, KEY_BACKEND, KEY_DIRECT,
+	KEY_SIZE, KEY_BLOCKSIZE, KEY_INODE_RATIO, KEY_GROUP_BLOCKS, KEY_JOURNAL, KEY_MKFS };
+
+static const struct fuse_opt rufs_opt_spec[] = {
+	FUSE_OPT_KEY("noatime", KEY_NOATIME),
+	FUSE_OPT_KEY("relatime", KEY_RELATIME),
+	FUSE_OPT_KEY("strictatime", KEY_STRICTATIME),
+	FUSE_OPT_KEY("commit=", KEY_COMMIT),
+	FUSE_OPT_KEY("readahead=", KEY_READAHEAD),
+	FUSE_OPT_KEY("sync_readahead", KEY_SYNC_READAHEAD),
+	FUSE_OPT_KEY("backend=", KEY_BACKEND),
+	FUSE_OPT_KEY("direct", KEY_DIRECT),
+	FUSE_OPT_KEY("size=", KEY_SIZE),
+	FUSE_OPT_KEY("blocksize=", KEY_BLOCKSIZE),
+	FUSE_OPT_KEY("inode_ratio=", KEY_INODE_RATIO),
+	FUSE_OPT_KEY("group_blocks=", KEY_GROUP_BLOCKS),
+	FUSE_OPT_KEY("journal=", KEY_JOURNAL),
+	FUSE_OPT_KEY("mkfs", KEY_MKFS),
+	FUSE_OPT_END
 };
 
+// Parse a byte count with an optional K, M or G suffix, returns -1 if it is malformed
+static off_t parse_size(const char *s) {
+	char *end;
+	long long n = strtoll(s,&end,10);
+	switch(*end) {
+	case 'G': case 'g': n *= 1024;	// fall through
+	case 'M': case 'm': n *= 1024;	// fall through
+	case 'K': case 'k': n *= 1024;
+		end++;
+	}
+	return (end == s || *end || n <= 0) ? -1 : n;
+}
+
+// Consume the rufs mount options and pass everything else on to FUSE
+static int rufs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+	struct rufs_options *opts = data;
+	switch(key) {
+	case KEY_NOATIME:
+		opts->atime = ATIME_NOATIME;
+		return 0;
+	case KEY_RELATIME:
+		opts->atime = ATIME_RELATIME;
+		return 0;
+	case KEY_STRICTATIME:
+		opts->atime = ATIME_STRICT;
+		return 0;
+	case KEY_COMMIT:
+		opts->commit = atoi(arg + strlen("commit="));
+		return 0;
+	case KEY_READAHEAD:
+		opts->readahead = atoi(arg + strlen("readahead="));
+		return 0;
+	case KEY_SYNC_READAHEAD:
+		opts->sync_readahead = 1;
+		return 0;
+	case KEY_BACKEND:
+		if(dev_set_backend(arg + strlen("backend="))) {
+			fprintf(stderr, "rufs: unknown backend %s\n", arg + strlen("backend="));
+			return -1;
+		}
+		return 0;
+	case KEY_DIRECT:
+		dev_set_direct(1);
+		return 0;
+	case KEY_SIZE:
+		if((opts->size = parse_size(arg + strlen("size="))) < 0) {
+			fprintf(stderr, "rufs: bad size %s\n", arg + strlen("size="));
+			return -1;
+		}
+		return 0;
+	case KEY_BLOCKSIZE:
+		opts->block_size = atoi(arg + strlen("blocksize="));
+		return 0;
+	case KEY_INODE_RATIO:
+		opts->inode_ratio = atoi(arg + strlen("inode_ratio="));
+		return 0;
+	case KEY_GROUP_BLOCKS:
+		opts->group_blocks = atoi(arg + strlen("group_blocks="));
+		return 0;
+	case KEY_JOURNAL:
+		opts->journal_blocks = atoi(arg + strlen("journal="));
+		return 0;
+	case KEY_MKFS:
+		opts->mkfs = 1;
+		return 0;
+	}
+	return 1;
+}
 
 int main(int argc, char *argv[]) {
 	int fuse_stat;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
+	if(fuse_opt_parse(&args, &rufs_opts, rufs_opt_spec, rufs_opt_proc) == -1)
+		return 1;
 	// printf("calling fuse main\n");
-	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	fuse_stat = fuse_main(args.argc, args.argv, &rufs_ope, NULL);
+	fuse_opt_free_args(&args);
 	// printf("fuse main done\n");
 	return fuse_stat;
 }
+
+#endif
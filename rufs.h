@@ -13,31 +13,128 @@
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 8192
+#define MAGIC_NUM 0x5C3C				/* 0x5C3A and 0x5C3B images have no block groups */
+
+/* mkfs defaults */
+#define RUFS_DEFAULT_SIZE			(32 * 1024 * 1024)
+#define RUFS_DEFAULT_INODE_RATIO	32768	/* bytes of disk per inode */
+#define RUFS_MAX_INUM				UINT16_MAX	/* inode numbers are 16-bit, UINT16_MAX is never used */
+#define RUFS_MIN_BLOCKS				64
+#define RUFS_MIN_GROUP_DATA			16		/* a short last group needs this many data blocks */
+#define RUFS_MAX_JOURNAL			4096	/* default journal is 1/16 of the disk up to this many blocks */
+#define RUFS_MIN_JOURNAL			64
+
+/* superblock feature flags */
+#define RUFS_FEATURE_EXTENTS	0x0001	/* new inodes map their blocks with extents */
+#define RUFS_FEATURE_DIR_INDEX	0x0002	/* directories outgrowing one block get a hashed index */
+#define RUFS_FEATURE_PACKED_DIRENT	0x0004	/* new directories store variable-length entries */
+#define RUFS_FEATURE_JOURNAL	0x0008	/* metadata goes through the journal (journal.h) */
+#define RUFS_DEFAULT_FEATURES	(RUFS_FEATURE_EXTENTS | RUFS_FEATURE_DIR_INDEX | RUFS_FEATURE_PACKED_DIRENT)
+
+/* inode flags, kept above the st_mode bits of inode.type */
+#define RUFS_EXTENTS_FL		0x10000	/* block map is an extent tree */
+#define RUFS_INDEX_FL		0x20000	/* directory has a hashed index in block 0 */
+#define RUFS_PACKED_FL		0x40000	/* directory blocks hold struct dirent_packed records */
 
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
-	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
-	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
-	uint32_t	i_start_blk;		/* start block of inode region */
-	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	block_size;			/* bytes per block, must match BLOCK_SIZE */
+	uint32_t	max_inum;			/* maximum inode number */
+	uint32_t	max_dnum;			/* maximum data block number, blocks on the disk */
+	uint32_t	blocks_per_group;	/* blocks covered by one block group */
+	uint32_t	inodes_per_group;	/* inodes in each group's inode table */
+	uint32_t	groups;				/* number of block groups */
+	uint32_t	gdt_blk;			/* start block of the group descriptor table */
+	uint32_t	features;			/* RUFS_FEATURE_* flags */
+	uint32_t	journal_blk;		/* start block of the journal, after group 0's inode table */
+	uint32_t	journal_blocks;		/* blocks in the journal */
+};
+
+/*
+ * Block group descriptor, the table follows the superblock
+ * A group's bitmaps are one block each, so a group covers at most BITS_PER_BLOCK blocks
+ */
+#define BITS_PER_BLOCK			(BLOCK_SIZE * 8)
+
+struct group_desc {
+	uint32_t	block_bitmap;		/* block of the group's block bitmap */
+	uint32_t	inode_bitmap;		/* block of the group's inode bitmap */
+	uint32_t	inode_table;		/* start block of the group's inode table */
+	uint32_t	free_blocks;		/* free blocks in the group */
+	uint32_t	free_inodes;		/* free inodes in the group */
+	uint32_t	used_dirs;			/* directories in the group */
+	uint32_t	reserved[2];
+};
+
+/*
+ * Extent tree: a header followed by entries sorted by lblk
+ * At depth 0 entries are extents, at depth d > 0 each entry points (pblk) at a block of
+ * depth d - 1 holding the entries for logical blocks [lblk, next entry's lblk)
+ * The root lives in the inode and grows a level when it is full, up to EXTENT_MAX_DEPTH
+ */
+#define EXTENT_MAGIC 0xE47E
+#define EXTENT_MAX_DEPTH 2
+
+struct extent_header {
+	uint16_t	magic;				/* EXTENT_MAGIC */
+	uint16_t	entries;			/* number of entries in use */
+	uint16_t	max;				/* capacity of this node */
+	uint16_t	depth;				/* levels of blocks below this node, 0 for leaves */
+};
+
+struct extent {
+	uint32_t	lblk;				/* first logical block */
+	uint32_t	pblk;				/* first physical block, or child block at depth > 0 */
+	uint32_t	len;				/* number of blocks, unused at depth > 0 */
 };
 
+/* block pointer map: direct_ptr, then single indirect blocks, then one double indirect block */
+#define DIRECT_PTRS			16
+#define SINGLE_INDIRECT		7		/* indirect_ptr[0..6], indirect_ptr[7] is double indirect */
+#define PTRS_PER_BLOCK		(BLOCK_SIZE / sizeof(int))
+
+#define EXTENTS_PER_INODE	7
+#define EXTENTS_PER_BLOCK	((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
+
 struct inode {
 	uint16_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
 	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
+	uint32_t	type;				/* type of the file, plus RUFS_*_FL flags */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
+	union {
+		struct {
+			int		direct_ptr[16];		/* direct pointer to data block */
+			int		indirect_ptr[8];	/* indirect pointer to data block */
+		};
+		struct {						/* with RUFS_EXTENTS_FL */
+			struct extent_header eh;	/* extent tree root */
+			struct extent ext[EXTENTS_PER_INODE];
+		};
+	};
 	struct stat	vstat;				/* inode stat */
 };
 
+/*
+ * Hashed directory index node: a header followed by records sorted by hash
+ */
+#define DX_MAGIC 0xD1C7
+
+struct dx_header {
+	uint16_t	magic;				/* DX_MAGIC */
+	uint8_t		depth;				/* levels of index blocks below the root */
+	uint8_t		reserved;
+	uint16_t	count;				/* records in use */
+	uint16_t	limit;				/* capacity of this node */
+};
+
+struct dx_entry {
+	uint32_t	hash;				/* lowest name hash covered */
+	uint32_t	lblk;				/* logical block of the child */
+};
+
+#define DX_ENTRIES_PER_BLOCK	((BLOCK_SIZE - sizeof(struct dx_header)) / sizeof(struct dx_entry))
+
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
@@ -45,6 +142,20 @@ struct dirent {
 	uint16_t len;					/* length of name */
 };
 
+/*
+ * Variable-length on-disk directory entry, rec_len covers the name and any
+ * padding up to the next record. An empty block is one record with name_len 0.
+ */
+struct dirent_packed {
+	uint32_t	ino;				/* inode number of the directory entry */
+	uint16_t	rec_len;			/* bytes to the next record */
+	uint8_t		name_len;			/* length of name, 0 if unused */
+	uint8_t		file_type;			/* reserved */
+	char		name[];				/* name, not NUL terminated */
+};
+
+#define DIRENT_PACKED_LEN(name_len)	((sizeof(struct dirent_packed) + (name_len) + 3) & ~3)
+
 
 /*
  * bitmap operations
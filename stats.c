@@ -0,0 +1,162 @@
+/*
+ *  Copyright (C) 2024 CS416/CS518 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	stats.c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+static const char *op_names[ST_OPS] = {
+	"getattr", "fgetattr", "opendir", "readdir", "releasedir", "mkdir", "rmdir",
+	"create", "open", "read", "write", "unlink", "truncate", "flush", "fsync",
+	"utimens", "release",
+	"bio_read", "bio_write", "bio_readv", "bio_writev",
+	"dev_read", "dev_write"
+};
+
+static const char *counter_names[SC_COUNTERS] = {
+	"cache_hits", "cache_misses", "dcache_hits", "dcache_misses",
+	"alloc_blocks", "alloc_inodes", "alloc_scans"
+};
+
+//Per-thread statistics, linked while the thread runs and folded into retired when it exits
+struct thread_stats {
+	struct stats s;
+	struct thread_stats *next;
+};
+
+static __thread struct thread_stats *self;
+static struct thread_stats *threads;
+static struct stats retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // threads and retired
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+//Only the owning thread writes its counters, relaxed stores keep concurrent readers race free
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define ADD(x, n)	STORE(x, LOAD(x) + (n))
+
+static void thread_exit(void *arg) {
+	struct thread_stats *t = arg;
+	pthread_mutex_lock(&stats_lock);
+	struct thread_stats **link = &threads;
+	while (*link != t)
+		link = &(*link)->next;
+	*link = t->next;
+	for (int i = 0; i < ST_OPS; i++) {
+		retired.op[i].calls += t->s.op[i].calls;
+		retired.op[i].errors += t->s.op[i].errors;
+		retired.op[i].bytes += t->s.op[i].bytes;
+		retired.op[i].ns += t->s.op[i].ns;
+		if (t->s.op[i].max_ns > retired.op[i].max_ns)
+			retired.op[i].max_ns = t->s.op[i].max_ns;
+	}
+	for (int i = 0; i < SC_COUNTERS; i++)
+		retired.count[i] += t->s.count[i];
+	pthread_mutex_unlock(&stats_lock);
+	free(t);
+}
+
+static void key_init() {
+	pthread_key_create(&stats_key, thread_exit);
+}
+
+//The calling thread's statistics, registered on first use, NULL if out of memory
+static struct stats *thread_stats() {
+	if (self)
+		return &self->s;
+	struct thread_stats *t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	pthread_once(&stats_once, key_init);
+	pthread_mutex_lock(&stats_lock);
+	t->next = threads;
+	threads = t;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(stats_key, t);
+	self = t;
+	return &t->s;
+}
+
+uint64_t stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//Account one call of op that started at start (stats_now()) and returned res
+void stats_op(int op, long res, uint64_t start) {
+	struct stats *s = thread_stats();
+	if (!s)
+		return;
+	uint64_t ns = stats_now() - start;
+	struct op_stats *o = &s->op[op];
+	ADD(o->calls, 1);
+	if (res < 0)
+		ADD(o->errors, 1);
+	else
+		ADD(o->bytes, res);
+	ADD(o->ns, ns);
+	if (ns > LOAD(o->max_ns))
+		STORE(o->max_ns, ns);
+}
+
+void stats_count(int counter, uint64_t n) {
+	struct stats *s = thread_stats();
+	if (s)
+		ADD(s->count[counter], n);
+}
+
+//Add up the exited threads and every running one
+void stats_sum(struct stats *st) {
+	pthread_mutex_lock(&stats_lock);
+	*st = retired;
+	for (struct thread_stats *t = threads; t; t = t->next) {
+		for (int i = 0; i < ST_OPS; i++) {
+			st->op[i].calls += LOAD(t->s.op[i].calls);
+			st->op[i].errors += LOAD(t->s.op[i].errors);
+			st->op[i].bytes += LOAD(t->s.op[i].bytes);
+			st->op[i].ns += LOAD(t->s.op[i].ns);
+			uint64_t max = LOAD(t->s.op[i].max_ns);
+			if (max > st->op[i].max_ns)
+				st->op[i].max_ns = max;
+		}
+		for (int i = 0; i < SC_COUNTERS; i++)
+			st->count[i] += LOAD(t->s.count[i]);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+//Write a text report of the operations that ran and of every counter into buf
+//Returns the length of the whole report, which is truncated if it is size or more
+int stats_report(char *buf, size_t size) {
+	struct stats st;
+	size_t len = 0;
+	stats_sum(&st);
+	#define PUT(...) (len += snprintf(buf + (len < size ? len : size), len < size ? size - len : 0, __VA_ARGS__))
+	PUT("# op calls errors bytes total_us avg_us max_us\n");
+	for (int i = 0; i < ST_OPS; i++) {
+		struct op_stats *o = &st.op[i];
+		if (!o->calls)
+			continue;
+		PUT("%s %llu %llu %llu %llu %.2f %.2f\n", op_names[i], (unsigned long long)o->calls,
+			(unsigned long long)o->errors, (unsigned long long)o->bytes,
+			(unsigned long long)(o->ns / 1000), o->ns / 1000.0 / o->calls, o->max_ns / 1000.0);
+	}
+	PUT("# counter value\n");
+	for (int i = 0; i < SC_COUNTERS; i++)
+		PUT("%s %llu\n", counter_names[i], (unsigned long long)st.count[i]);
+	#undef PUT
+	return len;
+}
@@ -0,0 +1,54 @@
+/*
+ *  Copyright (C) 2024 CS416/CS518 Rutgers CS
+ *	Tiny File System
+ *	File:	stats.h
+ *
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Operation statistics: every thread counts into its own struct stats and readers add
+ * up all threads, so the hot paths never share a cache line
+ */
+enum stats_op {
+	ST_GETATTR, ST_FGETATTR, ST_OPENDIR, ST_READDIR, ST_RELEASEDIR, ST_MKDIR, ST_RMDIR,
+	ST_CREATE, ST_OPEN, ST_READ, ST_WRITE, ST_UNLINK, ST_TRUNCATE, ST_FLUSH, ST_FSYNC,
+	ST_UTIMENS, ST_RELEASE,
+	ST_BIO_READ, ST_BIO_WRITE, ST_BIO_READV, ST_BIO_WRITEV,
+	ST_DEV_READ, ST_DEV_WRITE,			/* requests handed to the device backend */
+	ST_OPS
+};
+
+enum stats_counter {
+	SC_CACHE_HIT, SC_CACHE_MISS,		/* block cache lookups */
+	SC_DCACHE_HIT, SC_DCACHE_MISS,		/* dentry cache lookups */
+	SC_ALLOC_BLOCKS, SC_ALLOC_INODES,	/* blocks and inodes allocated */
+	SC_ALLOC_SCANS,						/* group bitmaps searched by the allocators */
+	SC_COUNTERS
+};
+
+struct op_stats {
+	uint64_t	calls;
+	uint64_t	errors;					/* calls that returned < 0 */
+	uint64_t	bytes;					/* sum of the positive results */
+	uint64_t	ns;						/* total latency */
+	uint64_t	max_ns;
+};
+
+struct stats {
+	struct op_stats op[ST_OPS];
+	uint64_t count[SC_COUNTERS];
+};
+
+uint64_t stats_now();
+void stats_op(int op, long res, uint64_t start);
+void stats_count(int counter, uint64_t n);
+void stats_sum(struct stats *st);
+int stats_report(char *buf, size_t size);
+
+#endif